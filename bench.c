@@ -0,0 +1,505 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define FLAG_IMPLEMENTATION
+#include "flag.h"
+
+void usage(FILE *sink, const char *program)
+{
+    fprintf(sink, "Usage: %s [OPTIONS] [--] <blacklist-binary>\n\n", program);
+    fprintf(sink, "    blacklist-binary: the build to measure, on a generated blacklist-file and stdin\n");
+    fprintf(sink, "                      the results go to --output as one JSON object per line\n\n");
+    fprintf(sink, "OPTIONS:\n");
+    flag_print_options(sink);
+}
+
+// What the generated files look like, the same parameters give the same bytes
+typedef struct {
+    uint64_t seed;
+    uint64_t keys;
+    uint64_t lines;
+    uint64_t min_len;
+    uint64_t max_len;
+    uint64_t hit_percent;   // Lines of stdin that are keys
+    uint64_t dup_percent;   // Lines of stdin that repeat an earlier line
+} GenOptions;
+
+// splitmix64, every line is generated from its own state
+static inline uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// A path of min_len to max_len bytes: directories and a file name of hex
+// digits, different for every state
+static size_t genPath(const GenOptions *gen, uint64_t state, char *buff) {
+    static const char digits[] = "0123456789abcdef";
+    size_t len = gen->min_len + mix(state) % (gen->max_len - gen->min_len + 1);
+    size_t segment = 0;
+    for (size_t i = 0; i < len; ++i) {
+        state = mix(state);
+        if (i == 0 || (segment >= 3 && state % 8 == 0 && i + 1 < len)) {
+            buff[i] = '/';
+            segment = 0;
+        } else {
+            buff[i] = digits[state >> 60];
+            ++segment;
+        }
+    }
+    return len;
+}
+
+static size_t genKey(const GenOptions *gen, uint64_t k, char *buff) {
+    return genPath(gen, mix(gen->seed) ^ k, buff);
+}
+
+// Line i of stdin, a key, a repeat of an earlier line or a path that is
+// not listed
+static size_t genLine(const GenOptions *gen, uint64_t i, char *buff) {
+    for (;;) {
+        uint64_t r = mix(mix(gen->seed + 1) ^ i);
+        uint64_t percent = r % 100;
+        if (i > 0 && percent < gen->dup_percent) {
+            i = (r >> 8) % i;
+            continue;
+        }
+        if (gen->keys && (percent - gen->dup_percent) * 100 < gen->hit_percent * (100 - gen->dup_percent))
+            return genKey(gen, (r >> 8) % gen->keys, buff);
+        return genPath(gen, mix(gen->seed + 2) ^ i, buff);
+    }
+}
+
+static void genFile(const char *path, uint64_t count, size_t (*line)(const GenOptions *, uint64_t, char *),
+                    const GenOptions *gen, uint64_t *bytes) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("Error creating file");
+        exit(EXIT_FAILURE);
+    }
+    char *buff = malloc(gen->max_len + 1);
+    if (!buff) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+    *bytes = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        size_t len = line(gen, i, buff);
+        buff[len] = '\n';
+        fwrite(buff, 1, len + 1, f);
+        *bytes += len + 1;
+    }
+    if (fclose(f) != 0) {
+        perror("Error writing file");
+        exit(EXIT_FAILURE);
+    }
+    free(buff);
+}
+
+typedef struct {
+    double seconds;
+    long peak_rss_kb;
+} RunResult;
+
+// Runs the command with stdin from the file and stdout to out, or to
+// /dev/null if out is NULL
+static RunResult runCommand(char **argv, const char *input, const char *out) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error forking");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int in = open(input, O_RDONLY);
+        int sink = open(out ? out : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (in < 0 || sink < 0 || dup2(in, STDIN_FILENO) < 0 || dup2(sink, STDOUT_FILENO) < 0) {
+            perror("Error redirecting");
+            _exit(127);
+        }
+        execv(argv[0], argv);
+        perror("Error running the blacklist");
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            perror("Error waiting");
+            exit(EXIT_FAILURE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "ERROR: %s", argv[0]);
+        for (char **arg = argv + 1; *arg; ++arg)
+            fprintf(stderr, " %s", *arg);
+        fprintf(stderr, " failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return (RunResult) {
+        .seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+        .peak_rss_kb = usage.ru_maxrss,
+    };
+}
+
+// The fastest of some runs, the others only saw more noise
+static RunResult runBest(char **argv, const char *input, uint64_t runs) {
+    RunResult best = runCommand(argv, input, NULL);
+    for (uint64_t i = 1; i < runs; ++i) {
+        RunResult r = runCommand(argv, input, NULL);
+        if (r.seconds < best.seconds)
+            best = r;
+    }
+    return best;
+}
+
+// Whether the two files have the same bytes
+static bool sameFile(const char *a, const char *b) {
+    FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+    if (!fa || !fb) {
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
+    }
+    int ca, cb;
+    do {
+        ca = getc(fa);
+        cb = getc(fb);
+    } while (ca == cb && ca != EOF);
+    fclose(fa);
+    fclose(fb);
+    return ca == cb;
+}
+
+#define LARGE_HOLE ((off_t)1 << 32) // Offset of the keys after the first in the sparse file
+#define LARGE_KEYS 64               // Of the sparse file, stdin has as many others
+
+// A sparse blacklist-file over 4 GiB, a key and then a hole of empty lines
+// before the other keys, stdin of them and of as many that are not listed,
+// and what the blacklist prints for that
+static void genSparse(const char *path, const char *input, const char *expect, const GenOptions *gen) {
+    FILE *f = fopen(path, "w"), *in = fopen(input, "w"), *out = fopen(expect, "w");
+    char *buff = malloc(gen->max_len + 1);
+    if (!f || !in || !out || !buff) {
+        perror("Error creating file");
+        exit(EXIT_FAILURE);
+    }
+    for (uint64_t k = 0; k < 2 * LARGE_KEYS; ++k) {
+        size_t len = genKey(gen, k, buff);
+        buff[len] = '\n';
+        if (k == 1 && fseeko(f, LARGE_HOLE, SEEK_SET) != 0) {
+            perror("Error seeking");
+            exit(EXIT_FAILURE);
+        }
+        fwrite(buff, 1, len + 1, k < LARGE_KEYS ? f : out);
+        fwrite(buff, 1, len + 1, in);
+    }
+    if (fclose(f) != 0 || fclose(in) != 0 || fclose(out) != 0) {
+        perror("Error writing file");
+        exit(EXIT_FAILURE);
+    }
+    free(buff);
+}
+
+// A blacklist-file of a key and of a key over 4 GiB, key 1 over and over.
+// Its length is 4 GiB more than that of key 1, which has to stay unlisted.
+static void genLongKey(const char *path, const char *input, const char *expect, const GenOptions *gen) {
+    FILE *f = fopen(path, "w"), *in = fopen(input, "w"), *out = fopen(expect, "w");
+    char *buff = malloc(gen->max_len + 1);
+    size_t block_size = 1 << 20;
+    char *block = malloc(block_size + gen->max_len);
+    if (!f || !in || !out || !buff || !block) {
+        perror("Error creating file");
+        exit(EXIT_FAILURE);
+    }
+    size_t len = genKey(gen, 0, buff);
+    buff[len] = '\n';
+    fwrite(buff, 1, len + 1, f);
+    fwrite(buff, 1, len + 1, in);
+
+    len = genKey(gen, 1, buff);
+    for (size_t i = 0; i < block_size + gen->max_len; ++i)
+        block[i] = buff[i % len];
+    // A whole number of repeats, so every block starts with the key
+    size_t step = block_size / len * len;
+    uint64_t left = ((uint64_t)1 << 32) + len;
+    for (; left > step; left -= step)
+        fwrite(block, 1, step, f);
+    fwrite(block, 1, left, f);
+    fputc('\n', f);
+
+    buff[len] = '\n';
+    fwrite(buff, 1, len + 1, in);
+    fwrite(buff, 1, len + 1, out);
+    len = genKey(gen, 2, buff);
+    buff[len] = '\n';
+    fwrite(buff, 1, len + 1, in);
+    fwrite(buff, 1, len + 1, out);
+    if (fclose(f) != 0 || fclose(in) != 0 || fclose(out) != 0) {
+        perror("Error writing file");
+        exit(EXIT_FAILURE);
+    }
+    free(block);
+    free(buff);
+}
+
+#define MAX_ARGS 8
+
+// A way to run the blacklist, measured once with empty stdin for the build
+// of its index and once filtering the generated stdin
+typedef struct {
+    const char *name;
+    const char *args[MAX_ARGS]; // Before the blacklist-file
+    int list;                   // Which blacklist-file, see main
+} Scenario;
+
+enum { LIST_KEYS, LIST_SMALL, LIST_COMPILED, LIST_SPARSE, LIST_LONG, LIST_LONG_COMPILED };
+
+static const Scenario scenarios[] = {
+    { "exact", { NULL }, LIST_KEYS },
+    { "exact-hash", { "--index", "hash" }, LIST_KEYS },
+    { "exact-inline", { "--index", "inline" }, LIST_KEYS },
+    { "uniq", { "-u" }, LIST_KEYS },
+    { "ignore-case", { "-i" }, LIST_KEYS },
+    { "mph", { "--mph" }, LIST_KEYS },
+    { "bloom", { "--bloom", "10" }, LIST_KEYS },
+    { "compiled", { NULL }, LIST_COMPILED },
+    { "small-list", { NULL }, LIST_SMALL },
+    { "jobs", { "-j", "0" }, LIST_KEYS },
+};
+
+// Of --large, run once each and checked against the output they should have
+static const Scenario large_scenarios[] = {
+    { "large-sparse", { NULL }, LIST_SPARSE },
+    { "large-sparse-jobs", { "-j", "0" }, LIST_SPARSE },
+    { "large-sparse-grace", { "--memory-limit", "1M" }, LIST_SPARSE },
+    { "large-key", { NULL }, LIST_LONG },
+    { "large-key-inline", { "--index", "inline" }, LIST_LONG },
+    { "large-key-sorted", { "--index", "sorted" }, LIST_LONG },
+    { "large-key-mph", { "--mph" }, LIST_LONG },
+    { "large-key-grace", { "--memory-limit", "1M" }, LIST_LONG },
+    { "large-key-compiled", { NULL }, LIST_LONG_COMPILED },
+};
+
+// The command of a scenario with the blacklist-file, cmd needs MAX_ARGS + 3 entries
+static void scenarioArgv(const Scenario *sc, char *binary, char *list, char **cmd) {
+    size_t n = 0;
+    cmd[n++] = binary;
+    for (size_t a = 0; a < MAX_ARGS && sc->args[a]; ++a)
+        cmd[n++] = (char *)sc->args[a];
+    cmd[n++] = list;
+    cmd[n] = NULL;
+}
+
+#define SMALL_KEYS 16
+
+int main(int argc, char **argv)
+{
+    const char *program = argv[0];
+    bool *help = flag_bool("help", 'h', "Print this help to stdout and exit with 0");
+    uint64_t *seed = flag_uint64("seed", 1, "Seed of the generated files");
+    uint64_t *keys = flag_uint64("keys", 1000000, "Lines of the blacklist-file");
+    uint64_t *lines = flag_uint64("lines", 4000000, "Lines of stdin");
+    uint64_t *min_len = flag_uint64("min-len", 16, "Shortest line, lengths are uniform up to --max-len");
+    uint64_t *max_len = flag_uint64("max-len", 64, "Longest line");
+    uint64_t *hit_percent = flag_uint64("hit-percent", 10, "Lines of stdin that are in the blacklist-file, in percent");
+    uint64_t *dup_percent = flag_uint64("dup-percent", 10, "Lines of stdin that repeat an earlier one, in percent");
+    uint64_t *runs = flag_uint64("runs", 3, "Runs of every benchmark, the fastest counts");
+    char **output = flag_str("output", "bench_output.txt", "File of the results");
+    char **only = flag_str("only", NULL, "Only run the benchmarks whose name contains this");
+    bool *large = flag_bool("large", 0, "Also check blacklist-files over 4 GiB, sparse and with a key over 4 GiB. "
+                            "Takes minutes and 8 GiB in $TMPDIR");
+
+    if (!flag_parse(argc, argv)) {
+        usage(stderr, program);
+        flag_print_error(stderr);
+        exit(1);
+    }
+    argv = flag_rest_argv();
+
+    if (*help) {
+        usage(stdout, program);
+        exit(0);
+    }
+    if (flag_rest_argc() != 1 || *min_len == 0 || *min_len > *max_len || *hit_percent > 100
+            || *dup_percent > 100 || *runs == 0) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: needs the blacklist binary, 0 < --min-len <= --max-len, percents up to 100 "
+                "and at least one run\n");
+        exit(1);
+    }
+    char *binary = argv[0];
+
+    const char *tmp = getenv("TMPDIR");
+    char dir[PATH_MAX - 32];   // Room for the file names in it
+    snprintf(dir, sizeof(dir), "%s/blacklist-bench-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(dir)) {
+        perror("Error creating temporary directory");
+        exit(EXIT_FAILURE);
+    }
+    char list[PATH_MAX], small[PATH_MAX], compiled[PATH_MAX], input[PATH_MAX], empty[PATH_MAX];
+    snprintf(list, sizeof(list), "%s/list.txt", dir);
+    snprintf(small, sizeof(small), "%s/small.txt", dir);
+    snprintf(compiled, sizeof(compiled), "%s/list.blx", dir);
+    snprintf(input, sizeof(input), "%s/input.txt", dir);
+    snprintf(empty, sizeof(empty), "%s/empty.txt", dir);
+
+    GenOptions gen = {
+        .seed = *seed, .keys = *keys, .lines = *lines, .min_len = *min_len, .max_len = *max_len,
+        .hit_percent = *hit_percent, .dup_percent = *dup_percent,
+    };
+    uint64_t list_bytes, small_bytes, input_bytes, empty_bytes;
+    genFile(list, *keys, genKey, &gen, &list_bytes);
+    genFile(small, *keys < SMALL_KEYS ? *keys : SMALL_KEYS, genKey, &gen, &small_bytes);
+    genFile(input, *lines, genLine, &gen, &input_bytes);
+    genFile(empty, 0, genLine, &gen, &empty_bytes);
+    char *compile_argv[] = { binary, "--compile", list, "-o", compiled, NULL };
+    runCommand(compile_argv, empty, NULL);
+
+    FILE *results = fopen(*output, "w");
+    if (!results) {
+        perror("Error creating output");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(results, "{\"bench\":\"setup\",\"binary\":\"%s\",\"time\":%lld,\"seed\":%" PRIu64 ",\"keys\":%" PRIu64
+            ",\"lines\":%" PRIu64 ",\"min_len\":%" PRIu64 ",\"max_len\":%" PRIu64 ",\"hit_percent\":%" PRIu64
+            ",\"dup_percent\":%" PRIu64 ",\"list_bytes\":%" PRIu64 ",\"input_bytes\":%" PRIu64 ",\"runs\":%" PRIu64 "}\n",
+            binary, (long long)time(NULL), *seed, *keys, *lines, *min_len, *max_len, *hit_percent, *dup_percent,
+            list_bytes, input_bytes, *runs);
+
+    printf("%-14s %9s %9s %9s %10s %8s %9s %10s\n",
+           "bench", "build s", "filter s", "total s", "Mlines/s", "GB/s", "ns/line", "RSS KiB");
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); ++s) {
+        const Scenario *sc = &scenarios[s];
+        if (*only && !strstr(sc->name, *only))
+            continue;
+        char *cmd[MAX_ARGS + 3];
+        scenarioArgv(sc, binary, sc->list == LIST_SMALL ? small : sc->list == LIST_COMPILED ? compiled : list, cmd);
+
+        RunResult build = runBest(cmd, empty, *runs);
+        RunResult total = runBest(cmd, input, *runs);
+        // What filtering takes on top of loading the blacklist
+        double filter = total.seconds > build.seconds ? total.seconds - build.seconds : 1e-9;
+        double lines_per_s = *lines / filter;
+        double gb_per_s = input_bytes / filter / 1e9;
+        double ns_per_line = *lines ? filter * 1e9 / *lines : 0;
+
+        printf("%-14s %9.3f %9.3f %9.3f %10.2f %8.3f %9.1f %10ld\n", sc->name, build.seconds, filter,
+               total.seconds, lines_per_s / 1e6, gb_per_s, ns_per_line, total.peak_rss_kb);
+        fprintf(results, "{\"bench\":\"%s\",\"build_s\":%.6f,\"build_rss_kb\":%ld,\"filter_s\":%.6f,\"total_s\":%.6f"
+                ",\"lines_per_s\":%.0f,\"gb_per_s\":%.4f,\"ns_per_line\":%.2f,\"peak_rss_kb\":%ld}\n",
+                sc->name, build.seconds, build.peak_rss_kb, filter, total.seconds, lines_per_s, gb_per_s,
+                ns_per_line, total.peak_rss_kb);
+        fflush(stdout);
+    }
+
+    // Offsets and lengths past 32 bits, only checked and timed once
+    if (*large) {
+        char sparse[PATH_MAX], sparse_input[PATH_MAX], sparse_expect[PATH_MAX];
+        char long_list[PATH_MAX], long_input[PATH_MAX], long_expect[PATH_MAX], long_compiled[PATH_MAX];
+        char out[PATH_MAX];
+        snprintf(sparse, sizeof(sparse), "%s/sparse.txt", dir);
+        snprintf(sparse_input, sizeof(sparse_input), "%s/sparse-input.txt", dir);
+        snprintf(sparse_expect, sizeof(sparse_expect), "%s/sparse-expect.txt", dir);
+        snprintf(long_list, sizeof(long_list), "%s/long.txt", dir);
+        snprintf(long_input, sizeof(long_input), "%s/long-input.txt", dir);
+        snprintf(long_expect, sizeof(long_expect), "%s/long-expect.txt", dir);
+        snprintf(long_compiled, sizeof(long_compiled), "%s/long.blx", dir);
+        snprintf(out, sizeof(out), "%s/out.txt", dir);
+        genSparse(sparse, sparse_input, sparse_expect, &gen);
+        genLongKey(long_list, long_input, long_expect, &gen);
+        char *long_compile_argv[] = { binary, "--compile", long_list, "-o", long_compiled, NULL };
+        runCommand(long_compile_argv, empty, NULL);
+
+        for (size_t s = 0; s < sizeof(large_scenarios) / sizeof(large_scenarios[0]); ++s) {
+            const Scenario *sc = &large_scenarios[s];
+            if (*only && !strstr(sc->name, *only))
+                continue;
+            char *cmd[MAX_ARGS + 3];
+            scenarioArgv(sc, binary, sc->list == LIST_SPARSE ? sparse : sc->list == LIST_LONG ? long_list
+                         : long_compiled, cmd);
+            RunResult r = runCommand(cmd, sc->list == LIST_SPARSE ? sparse_input : long_input, out);
+            if (!sameFile(out, sc->list == LIST_SPARSE ? sparse_expect : long_expect)) {
+                fprintf(stderr, "ERROR: %s printed the wrong lines, see %s\n", sc->name, out);
+                exit(EXIT_FAILURE);
+            }
+            printf("%-18s %9.3f s %10ld KiB ok\n", sc->name, r.seconds, r.peak_rss_kb);
+            fprintf(results, "{\"bench\":\"%s\",\"total_s\":%.6f,\"peak_rss_kb\":%ld,\"ok\":true}\n",
+                    sc->name, r.seconds, r.peak_rss_kb);
+            fflush(stdout);
+        }
+        unlink(sparse);
+        unlink(sparse_input);
+        unlink(sparse_expect);
+        unlink(long_list);
+        unlink(long_input);
+        unlink(long_expect);
+        unlink(long_compiled);
+        unlink(out);
+    }
+
+    // The hashes on their own, see --hash-bench of the blacklist
+    if (!*only || strstr("hash", *only)) {
+        char hashes[PATH_MAX];
+        snprintf(hashes, sizeof(hashes), "%s/hashes.txt", dir);
+        char *hash_argv[] = { binary, "--hash-bench", NULL };
+        runCommand(hash_argv, empty, hashes);
+        FILE *f = fopen(hashes, "r");
+        if (!f) {
+            perror("Error opening file");
+            exit(EXIT_FAILURE);
+        }
+        char line[256];
+        bool header = true;
+        while (fgets(line, sizeof(line), f)) {
+            double short_mb, long_mb;
+            char *end = line + strlen(line);
+            // The name may have spaces, the two numbers at the end do not
+            int numbers = 0;
+            while (end > line && numbers < 2) {
+                while (end > line && (end[-1] == ' ' || end[-1] == '\n'))
+                    --end;
+                while (end > line && end[-1] != ' ')
+                    --end;
+                ++numbers;
+            }
+            if (header || sscanf(end, "%lf %lf", &short_mb, &long_mb) != 2) {
+                header = false;
+                continue;
+            }
+            while (end > line && end[-1] == ' ')
+                --end;
+            *end = 0;
+            printf("hash %-9s %9.0f MB/s of 24 B keys %9.0f MB/s of 1 KiB\n", line, short_mb, long_mb);
+            fprintf(results, "{\"bench\":\"hash\",\"hash\":\"%s\",\"mb_per_s_24\":%.0f,\"mb_per_s_1024\":%.0f}\n",
+                    line, short_mb, long_mb);
+        }
+        fclose(f);
+        unlink(hashes);
+    }
+
+    if (fclose(results) != 0) {
+        perror("Error writing output");
+        exit(EXIT_FAILURE);
+    }
+    unlink(list);
+    unlink(small);
+    unlink(compiled);
+    unlink(input);
+    unlink(empty);
+    rmdir(dir);
+    return EXIT_SUCCESS;
+}
@@ -1,203 +1,5364 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
 
-#include "uthash.h"
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
+#include "blacklist.h"
+
+// Built with BLACKLIST_LIBRARY this is libblacklist, the command left out
+#ifndef BLACKLIST_LIBRARY
 #define FLAG_IMPLEMENTATION
 #include "flag.h"
 
-void usage(FILE *sink, const char *program)
-{
-    fprintf(sink, "Usage: %s [OPTIONS] [--] <blacklist-file> ... \n\n", program);
-    fprintf(sink, "    blacklist-file: reads stdin and only if the line is not in the blacklist-file, it is printed to stdout\n\n");
-    fprintf(sink, "OPTIONS:\n");
-    flag_print_options(sink);
+void usage(FILE *sink, const char *program)
+{
+    fprintf(sink, "Usage: %s [OPTIONS] [--] <blacklist-file> ... \n\n", program);
+    fprintf(sink, "    blacklist-file: reads stdin and only if the line is not in the blacklist-file, it is printed to stdout\n");
+    fprintf(sink, "                    with several files a line counts as listed if it is in any of them, see --all and --select\n\n");
+    fprintf(sink, "OPTIONS:\n");
+    flag_print_options(sink);
+}
+#endif
+
+// Where fail returns to while a call of the library runs, see blacklist.h
+static _Thread_local jmp_buf *failJump;
+
+// What a function holds while it may fail, released by fail() in the order
+// pushed back, see failPush
+typedef struct FailCleanup {
+    void (*release)(void *arg);
+    void *arg;
+    struct FailCleanup *next;
+} FailCleanup;
+
+static _Thread_local FailCleanup *failCleanups;
+
+// Has fail() release arg until failPop, cleanup lives in the frame of the caller
+static void failPush(FailCleanup *cleanup, void (*release)(void *arg), void *arg) {
+    *cleanup = (FailCleanup) { .release = release, .arg = arg, .next = failCleanups };
+    failCleanups = cleanup;
+}
+
+static void failPop(FailCleanup *cleanup) {
+    failCleanups = cleanup->next;
+}
+
+// Gives up after an error that has been printed: the program exits, a call
+// of the library returns its error instead
+static _Noreturn void fail(void) {
+    while (failCleanups) {
+        FailCleanup *cleanup = failCleanups;
+        failCleanups = cleanup->next;
+        cleanup->release(cleanup->arg);
+    }
+    if (failJump)
+        longjmp(*failJump, 1);
+    exit(EXIT_FAILURE);
+}
+
+typedef struct {
+    const char *data;
+    size_t size;
+    bool mapped;    // data is a mapping of the file, otherwise heap memory
+} FileBuffer;
+
+void freeFileBuffer(FileBuffer *file) {
+    if (file->mapped)
+        munmap((void *)file->data, file->size);
+    else if (file->size)
+        free((void *)file->data);
+    file->data = NULL;
+    file->size = 0;
+}
+
+// Reads a stream that cannot be mapped (pipe, fifo, ...) into the heap
+static void readStream(int fd, FileBuffer *file) {
+    size_t capacity = 1 << 16;
+    char *buffer = malloc(capacity);
+    size_t size = 0;
+    for (;;) {
+        if (!buffer) {
+            perror("Error allocating memory");
+            fail();
+        }
+        ssize_t n = read(fd, buffer + size, capacity - size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading file");
+            fail();
+        }
+        if (n == 0)
+            break;
+        size += n;
+        if (size == capacity)
+            buffer = realloc(buffer, capacity *= 2);
+    }
+    file->data = buffer;
+    file->size = size;
+    file->mapped = false;
+}
+
+// The files readFiles has open and the streams it has read
+typedef struct {
+    int *fds;
+    FileBuffer *streams;
+    size_t count;
+} OpenFiles;
+
+static void closeFiles(void *arg) {
+    OpenFiles *files = arg;
+    for (size_t i = 0; i < files->count; ++i) {
+        if (files->fds[i] >= 0)
+            close(files->fds[i]);
+        freeFileBuffer(&files->streams[i]);
+    }
+    free(files->fds);
+    free(files->streams);
+}
+
+// Maps the files read-only and back to back into one range of memory, so
+// that offsets into any of them share a base. Nothing is copied or written
+// to them, only streams (pipes, fifos, ...) have to be read and copied in.
+// The offset of every file in the range is stored in starts, its size in sizes.
+void readFiles(char **filenames, size_t count, FileBuffer *file, size_t *starts, size_t *sizes) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    OpenFiles open_files = {
+        .fds = malloc(count * sizeof(int)),
+        .streams = calloc(count, sizeof(FileBuffer)),
+    };
+    int *fds = open_files.fds;
+    FileBuffer *streams = open_files.streams;
+    if (!fds || !streams) {
+        free(fds);
+        free(streams);
+        perror("Error allocating memory");
+        fail();
+    }
+    FailCleanup cleanup;
+    failPush(&cleanup, closeFiles, &open_files);
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        fds[i] = open(filenames[i], O_RDONLY);
+        open_files.count = i + 1;
+        struct stat st;
+        if (fds[i] < 0 || fstat(fds[i], &st) < 0) {
+            fprintf(stderr, "Error opening file %s: %s\n", filenames[i], strerror(errno));
+            fail();
+        }
+        if (S_ISREG(st.st_mode)) {
+            sizes[i] = st.st_size;
+        } else {
+            readStream(fds[i], &streams[i]);
+            sizes[i] = streams[i].size;
+        }
+        starts[i] = total;
+        total += (sizes[i] + page - 1) / page * page;
+    }
+
+    file->data = "";
+    file->size = 0;
+    file->mapped = false;
+    if (total > 0) {
+        char *base = mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) {
+            perror("Error mapping file");
+            fail();
+        }
+        file->data = base;
+        file->size = total;
+        file->mapped = true;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        char *at = (char *)file->data + starts[i];
+        if (sizes[i] == 0) {
+            // Nothing to map
+        } else if (streams[i].data) {
+            if (mmap(at, sizes[i], PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+                perror("Error mapping file");
+                fail();
+            }
+            memcpy(at, streams[i].data, sizes[i]);
+            mprotect(at, sizes[i], PROT_READ);
+            freeFileBuffer(&streams[i]);
+        } else {
+            if (mmap(at, sizes[i], PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, fds[i], 0) == MAP_FAILED) {
+                perror("Error mapping file");
+                fail();
+            }
+        }
+        close(fds[i]);
+        fds[i] = -1;
+    }
+    if (total > 0)
+        madvise((void *)file->data, total, MADV_SEQUENTIAL);
+
+    failPop(&cleanup);
+    closeFiles(&open_files);
+}
+
+#define KEYSET_MIN_BITS 4
+#define KEYSET_MAX_BITS 32  // The home slot is taken from the 32 bit tag
+
+// An open addressing (Robin Hood) hash set of keys stored elsewhere.
+// A slot only holds a fingerprint of the key and where to find it in the
+// `keys` buffer, so the table stays small and a lookup touches one slot run.
+typedef struct {
+    uint64_t off : 48;      // Offset of the key into the keys buffer
+    uint64_t len_high : 16; // Length of the key from bit 32 on, see slotLen
+    uint32_t len_low;
+    uint32_t tag;           // Upper hash bits, the home slot is its top bits, 0 if empty
+} Slot;
+
+static inline Slot makeSlot(uint64_t off, size_t len, uint32_t tag) {
+    return (Slot) { .off = off, .len_high = (uint64_t)len >> 32, .len_low = (uint32_t)len, .tag = tag };
+}
+
+static inline size_t slotLen(const Slot *slot) {
+    return slot->len_low | (size_t)slot->len_high << 32;
+}
+
+typedef struct {
+    const char *keys;
+    Slot *slots;
+    uint32_t *masks;    // Optional value per slot, moved along with the slots
+    uint32_t bits;      // log2 of the capacity
+    size_t count;
+    bool mapped;        // The slots belong to a mapped index file
+} KeySet;
+
+// ASCII lower case of a byte
+static inline char foldByte(char c) {
+    return (unsigned char)(c - 'A') < 26 ? c | 0x20 : c;
+}
+
+// ASCII lower case of the 8 bytes of a word at once
+static inline uint64_t foldWord(uint64_t w) {
+    const uint64_t high = 0x8080808080808080ULL;
+    uint64_t low7 = w & ~high;
+    uint64_t above_z = low7 + 0x2525252525252525ULL;    // 0x80 - 'Z' - 1
+    uint64_t from_a = low7 + 0x3f3f3f3f3f3f3f3fULL;     // 0x80 - 'A'
+    uint64_t upper = (from_a ^ above_z) & ~w & high;
+    return w | upper >> 2;
+}
+
+// The hash functions keys can be looked up with. Every one has a variant
+// that hashes the key as if it was in lower case, without copying it. A
+// compiled index records the hash it was built with, so the numbers must
+// not change.
+typedef enum {
+    HASH_FNV = 0,   // FNV-1a, a byte at a time, what older indices use
+    HASH_WY,        // wyhash, 16 bytes per multiply
+    HASH_CRC,       // CRC32C in two lanes, SSE4.2 or a table
+    HASH_COUNT,
+} HashKind;
+
+static const char *const hashNames[HASH_COUNT] = { "fnv", "wy", "crc" };
+
+// Build time default of --hash, "auto" picks the fastest on the CPU
+#ifndef DEFAULT_HASH
+#define DEFAULT_HASH "auto"
+#endif
+
+// The hash of every key set, see hashSelect
+static HashKind keyHash = HASH_FNV;
+static bool crcHardware = false;
+static uint32_t crcTable[256];
+
+// Murmur3 finalizer, so the top bits are well mixed
+static inline uint64_t hashFinish(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t readWord(const char *p, bool fold) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    return fold ? foldWord(w) : w;
+}
+
+static inline uint64_t readHalf(const char *p, bool fold) {
+    uint32_t w;
+    memcpy(&w, p, 4);
+    return fold ? foldWord(w) : w;
+}
+
+// The 1 to 3 bytes of a short key, first, middle and last
+static inline uint64_t readShort(const char *p, size_t len, bool fold) {
+    uint64_t w = (uint64_t)(unsigned char)p[0] << 16 | (uint64_t)(unsigned char)p[len >> 1] << 8
+        | (unsigned char)p[len - 1];
+    return fold ? foldWord(w) : w;
+}
+
+static inline uint64_t hashFnv(const char *key, size_t len, bool fold) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)(fold ? foldByte(key[i]) : key[i]);
+        h *= 0x100000001b3ULL;
+    }
+    return hashFinish(h);
+}
+
+static inline uint64_t wyMix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// wyhash (final version 4) with seed 0
+static inline uint64_t hashWy(const char *p, size_t len, bool fold) {
+    const uint64_t s0 = 0xa0761d6478bd642fULL, s1 = 0xe7037ed1a0b428dbULL;
+    const uint64_t s2 = 0x8ebc6af09c88c6e3ULL, s3 = 0x589965cc75374cc3ULL;
+    uint64_t seed = wyMix(s0, s1);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t mid = (len >> 3) << 2;
+            a = readHalf(p, fold) << 32 | readHalf(p + mid, fold);
+            b = readHalf(p + len - 4, fold) << 32 | readHalf(p + len - 4 - mid, fold);
+        } else if (len > 0) {
+            a = readShort(p, len, fold);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wyMix(readWord(p, fold) ^ s1, readWord(p + 8, fold) ^ seed);
+                see1 = wyMix(readWord(p + 16, fold) ^ s2, readWord(p + 24, fold) ^ see1);
+                see2 = wyMix(readWord(p + 32, fold) ^ s3, readWord(p + 40, fold) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wyMix(readWord(p, fold) ^ s1, readWord(p + 8, fold) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = readWord(p + i - 16, fold);
+        b = readWord(p + i - 8, fold);
+    }
+    a ^= s1;
+    b ^= seed;
+    __uint128_t r = (__uint128_t)a * b;
+    return wyMix((uint64_t)r ^ s0 ^ len, (uint64_t)(r >> 64) ^ s1);
+}
+
+// CRC32C of the key in two lanes, 8 bytes per step, and the finalizer to
+// spread the two 32 bit lanes over all bits. step is the CRC of one word.
+// Each lane only sees half of the words, and CRC is linear, so keys that
+// differ in a few bytes of both halves collide in both lanes far more
+// often than chance. The sum of the words, which is not linear, breaks that.
+#define HASH_CRC_BODY(step)                                             \
+    uint64_t a = 0x8f1bbcdc, b = 0xca62c1d6, sum = 0;                   \
+    size_t i = 0;                                                       \
+    for (; i + 16 <= len; i += 16) {                                    \
+        uint64_t w0 = readWord(key + i, fold), w1 = readWord(key + i + 8, fold); \
+        a = step(a, w0);                                                \
+        b = step(b, w1);                                                \
+        sum += w0 + w1;                                                 \
+    }                                                                   \
+    if (i + 8 <= len) {                                                 \
+        uint64_t w = readWord(key + i, fold);                           \
+        a = step(a, w);                                                 \
+        sum += w;                                                       \
+        i += 8;                                                         \
+    }                                                                   \
+    if (i < len) {                                                      \
+        uint64_t w = i + 4 <= len                                       \
+            ? readHalf(key + i, fold) << 32 | readHalf(key + len - 4, fold) \
+            : readShort(key + i, len - i, fold);                        \
+        b = step(b, w);                                                 \
+        sum += w;                                                       \
+    }                                                                   \
+    return hashFinish((a << 32 | b) ^ sum * 0x9e3779b97f4a7c15ULL ^ (uint64_t)len << 56 ^ len);
+
+static inline uint64_t crcStep(uint64_t crc, uint64_t word) {
+    for (int i = 0; i < 8; ++i)
+        crc = crcTable[(crc ^ (word >> (8 * i))) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static uint64_t hashCrcTable(const char *key, size_t len, bool fold) {
+    HASH_CRC_BODY(crcStep)
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint64_t hashCrcHardware(const char *key, size_t len, bool fold) {
+    HASH_CRC_BODY(_mm_crc32_u64)
+}
+#else
+static uint64_t hashCrcHardware(const char *key, size_t len, bool fold) {
+    return hashCrcTable(key, len, fold);
+}
+#endif
+
+static inline uint64_t hashWith(HashKind kind, const char *key, size_t len, bool fold) {
+    switch (kind) {
+    case HASH_WY:
+        return hashWy(key, len, fold);
+    case HASH_CRC:
+        return crcHardware ? hashCrcHardware(key, len, fold) : hashCrcTable(key, len, fold);
+    default:
+        return hashFnv(key, len, fold);
+    }
+}
+
+uint64_t hashKey(const char *key, size_t len) {
+    return hashWith(keyHash, key, len, false);
+}
+
+// hashKey of the key in lower case, folded on the way
+uint64_t hashKeyFold(const char *key, size_t len) {
+    return hashWith(keyHash, key, len, true);
+}
+
+// Sets the hash of all keys by name, or the fastest one the CPU has for
+// "auto". Returns false for an unknown name.
+bool hashSelect(const char *name) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        crcTable[i] = crc;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crcHardware = __builtin_cpu_supports("sse4.2");
+#endif
+
+    if (strcmp(name, "auto") == 0) {
+        keyHash = crcHardware ? HASH_CRC : HASH_WY;
+        return true;
+    }
+    for (int i = 0; i < HASH_COUNT; ++i) {
+        if (strcmp(name, hashNames[i]) == 0) {
+            keyHash = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+#if defined(__SSE2__)
+// Lower case of the 16 bytes, and which of them were upper case
+static inline __m128i foldBlock(__m128i v, int *upper) {
+    __m128i is_upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                     _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    *upper = _mm_movemask_epi8(is_upper);
+    return _mm_or_si128(v, _mm_and_si128(is_upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+// Turns the bytes to lower case, only writing blocks that change
+void foldInPlace(char *p, size_t len) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        int upper;
+        __m128i v = foldBlock(_mm_loadu_si128((const __m128i *)(p + i)), &upper);
+        if (upper)
+            _mm_storeu_si128((__m128i *)(p + i), v);
+    }
+#endif
+    for (; i < len; ++i) {
+        char c = foldByte(p[i]);
+        if (c != p[i])
+            p[i] = c;
+    }
+}
+
+// Whether the lower case key equals the line folded to lower case
+static inline bool foldEqual(const char *key, const char *line, size_t len) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        int upper;
+        __m128i v = foldBlock(_mm_loadu_si128((const __m128i *)(line + i)), &upper);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_loadu_si128((const __m128i *)(key + i)))) != 0xffff)
+            return false;
+    }
+#endif
+    for (; i < len; ++i)
+        if (key[i] != foldByte(line[i]))
+            return false;
+    return true;
+}
+
+static inline uint32_t hashTag(uint64_t hash) {
+    return (uint32_t)(hash >> 32) | 1;
+}
+
+static inline size_t slotHome(const KeySet *set, uint32_t tag) {
+    return tag >> (32 - set->bits);
+}
+
+void keySetInit(KeySet *set, const char *keys, size_t expected) {
+    uint32_t bits = KEYSET_MIN_BITS;
+    // Keep the load factor below 0.8
+    while (((size_t)1 << bits) * 4 < expected * 5 && bits < KEYSET_MAX_BITS)
+        ++bits;
+    set->keys = keys;
+    set->bits = bits;
+    set->count = 0;
+    set->mapped = false;
+    set->masks = NULL;
+    set->slots = calloc((size_t)1 << bits, sizeof(Slot));
+    if (!set->slots) {
+        perror("Error allocating memory");
+        fail();
+    }
+}
+
+// Gives every slot of the empty set a mask, see keySetInsertMask
+void keySetInitMasks(KeySet *set) {
+    set->masks = calloc((size_t)1 << set->bits, sizeof(uint32_t));
+    if (!set->masks) {
+        perror("Error allocating memory");
+        fail();
+    }
+}
+
+void freeKeySet(KeySet *set) {
+    if (!set->mapped) {
+        free(set->slots);
+        free(set->masks);
+    }
+    set->slots = NULL;
+    set->masks = NULL;
+    set->count = 0;
+}
+
+static inline const Slot *keySetLookup(const KeySet *set, const char *key, size_t len, uint64_t hash, bool fold) {
+    const size_t mask = ((size_t)1 << set->bits) - 1;
+    const uint32_t tag = hashTag(hash);
+
+    size_t i = slotHome(set, tag);
+    for (size_t dist = 0;; ++dist, i = (i + 1) & mask) {
+        const Slot *slot = &set->slots[i];
+        // The key would have displaced any entry closer to its home slot
+        if (!slot->tag || ((i - slotHome(set, slot->tag)) & mask) < dist)
+            return NULL;
+        if (slot->tag == tag && slotLen(slot) == len
+                && (fold ? foldEqual(set->keys + slot->off, key, len) : memcmp(set->keys + slot->off, key, len) == 0))
+            return slot;
+    }
+}
+
+const Slot *keySetFind(const KeySet *set, const char *key, size_t len, uint64_t hash) {
+    return keySetLookup(set, key, len, hash, false);
+}
+
+static void keySetPlace(KeySet *set, Slot entry, uint32_t value) {
+    const size_t mask = ((size_t)1 << set->bits) - 1;
+
+    size_t i = slotHome(set, entry.tag);
+    for (size_t dist = 0;; ++dist, i = (i + 1) & mask) {
+        Slot *slot = &set->slots[i];
+        if (!slot->tag) {
+            *slot = entry;
+            if (set->masks)
+                set->masks[i] = value;
+            return;
+        }
+        size_t slot_dist = (i - slotHome(set, slot->tag)) & mask;
+        if (slot_dist < dist) { // Robin Hood: take from the rich
+            Slot tmp = *slot;
+            *slot = entry;
+            entry = tmp;
+            if (set->masks) {
+                uint32_t tmp_value = set->masks[i];
+                set->masks[i] = value;
+                value = tmp_value;
+            }
+            dist = slot_dist;
+        }
+    }
+}
+
+static void keySetGrow(KeySet *set) {
+    Slot *old = set->slots;
+    uint32_t *old_masks = set->masks;
+    size_t old_cap = (size_t)1 << set->bits;
+
+    if (set->bits == KEYSET_MAX_BITS) {
+        fprintf(stderr, "Error building the index: too many keys\n");
+        fail();
+    }
+    set->bits += 1;
+    set->slots = calloc((size_t)1 << set->bits, sizeof(Slot));
+    if (old_masks)
+        set->masks = calloc((size_t)1 << set->bits, sizeof(uint32_t));
+    if (!set->slots || (old_masks && !set->masks)) {
+        perror("Error allocating memory");
+        fail();
+    }
+    // The home slot only depends on the tag, so no key has to be rehashed
+    for (size_t i = 0; i < old_cap; ++i)
+        if (old[i].tag)
+            keySetPlace(set, old[i], old_masks ? old_masks[i] : 0);
+    free(old);
+    free(old_masks);
+}
+
+// Adds the key at keys[off..off+len), which must not be in the set yet
+void keySetAdd(KeySet *set, uint64_t off, size_t len, uint64_t hash) {
+    if ((set->count + 1) * 5 > ((size_t)1 << set->bits) * 4)
+        keySetGrow(set);
+
+    keySetPlace(set, makeSlot(off, len, hashTag(hash)), 0);
+    ++set->count;
+}
+
+// Adds the key unless an equal key is present, returns true if it was added
+bool keySetInsert(KeySet *set, uint64_t off, size_t len, uint64_t hash) {
+    if (keySetFind(set, set->keys + off, len, hash))
+        return false;
+    keySetAdd(set, off, len, hash);
+    return true;
+}
+
+// Same as keySetInsert for a set with masks, the bits of mask are set in
+// the mask of the key whether it was present or not
+void keySetInsertMask(KeySet *set, uint64_t off, size_t len, uint64_t hash, uint32_t mask) {
+    const Slot *slot = keySetFind(set, set->keys + off, len, hash);
+    if (slot) {
+        set->masks[slot - set->slots] |= mask;
+        return;
+    }
+    if ((set->count + 1) * 5 > ((size_t)1 << set->bits) * 4)
+        keySetGrow(set);
+    keySetPlace(set, makeSlot(off, len, hashTag(hash)), mask);
+    ++set->count;
+}
+
+_Bool isLineSep(char ch) {
+    return ch == '\n' || ch == '\0';
+}
+
+// Bitmask of the line separators in the 64 bytes at p. Blacklist files also
+// split on '\0', stdin only on '\n'.
+static inline uint64_t sepMask64(const char *p, bool nul_sep) {
+#if defined(__AVX2__)
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = nul_sep ? _mm256_setzero_si256() : nl;
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+    uint32_t lo = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(a, nl), _mm256_cmpeq_epi8(a, zero)));
+    uint32_t hi = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(b, nl), _mm256_cmpeq_epi8(b, zero)));
+    return (uint64_t)hi << 32 | lo;
+#elif defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = nul_sep ? _mm_setzero_si128() : nl;
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        uint64_t m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, zero)));
+        mask |= m << (16 * i);
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; ++i)
+        mask |= (uint64_t)(nul_sep ? isLineSep(p[i]) : p[i] == '\n') << i;
+    return mask;
+#endif
+}
+
+// Same as sepMask64 for the last n < 64 bytes, never reads past them
+static uint64_t sepMaskTail(const char *p, size_t n, bool nul_sep) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < n; ++i)
+        mask |= (uint64_t)(nul_sep ? isLineSep(p[i]) : p[i] == '\n') << i;
+    return mask;
+}
+
+// Finds the line separators of a buffer 64 bytes at a time
+typedef struct {
+    const char *buff;
+    size_t size;
+    size_t block;   // Offset of the block the mask belongs to
+    uint64_t mask;  // Separators in the block not returned yet
+    bool nul_sep;
+} LineScanner;
+
+void lineScannerInit(LineScanner *sc, const char *buff, size_t size, bool nul_sep) {
+    sc->buff = buff;
+    sc->size = size;
+    sc->block = 0;
+    sc->nul_sep = nul_sep;
+    sc->mask = size >= 64 ? sepMask64(buff, nul_sep) : sepMaskTail(buff, size, nul_sep);
+}
+
+// Offset of the next line separator, or the buffer size if there is none
+static inline size_t nextLineSep(LineScanner *sc) {
+    while (!sc->mask) {
+        sc->block += 64;
+        if (sc->block >= sc->size)
+            return sc->size;
+        const char *p = sc->buff + sc->block;
+        size_t left = sc->size - sc->block;
+        sc->mask = left >= 64 ? sepMask64(p, sc->nul_sep) : sepMaskTail(p, left, sc->nul_sep);
+    }
+    size_t sep = sc->block + __builtin_ctzll(sc->mask);
+    sc->mask &= sc->mask - 1;
+    return sep;
+}
+
+// Guesses the number of lines from the line density of the first MiB.
+// Empty lines are not counted, they hold no key (and a sparse file is
+// nothing but them).
+size_t estimateLines(const char *buff, size_t size) {
+    LineScanner sc;
+    size_t sample = size < (1 << 20) ? size : (1 << 20);
+    size_t sample_lines = 1;
+    lineScannerInit(&sc, buff, sample, true);
+    for (size_t start = 0, sep; (sep = nextLineSep(&sc)) < sample; start = sep + 1)
+        sample_lines += sep > start;
+    return sample ? size / sample * sample_lines * 17 / 16 : 0;
+}
+
+// Bitmask of the bytes equal to c in the 64 bytes at p
+static inline uint64_t byteMask64(const char *p, char c) {
+#if defined(__AVX2__)
+    const __m256i v = _mm256_set1_epi8(c);
+    uint32_t lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), v));
+    uint32_t hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), v));
+    return (uint64_t)hi << 32 | lo;
+#elif defined(__SSE2__)
+    const __m128i v = _mm_set1_epi8(c);
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        uint64_t m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), v));
+        mask |= m << (16 * i);
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; ++i)
+        mask |= (uint64_t)(p[i] == c) << i;
+    return mask;
+#endif
+}
+
+// Offset of the n-th (from 0) byte c in the len bytes at p, or len
+static inline size_t findByte(const char *p, size_t len, char c, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint64_t mask = byteMask64(p + i, c);
+        size_t found = __builtin_popcountll(mask);
+        if (n < found) {
+            while (n--)
+                mask &= mask - 1;
+            return i + __builtin_ctzll(mask);
+        }
+        n -= found;
+    }
+    for (;;) {
+        const char *hit = memchr(p + i, c, len - i);
+        if (!hit)
+            return len;
+        i = hit - p;
+        if (n-- == 0)
+            return i;
+        ++i;
+    }
+}
+
+// Which part of a line is matched: field (from 1) of it split at delim, or
+// the whole line for field 0, and of that the bytes from to to. All 0 is
+// the whole line.
+typedef struct {
+    char delim;
+    size_t field;
+    size_t from;
+    size_t to;      // Exclusive, 0 for to the end
+    bool crlf;      // Drop a '\r' at the end of the line first
+    bool trim;      // Drop white space around the field before taking bytes
+    bool fold;      // ASCII case does not matter, keys are stored lower case
+} KeyField;
+
+// Whether the key is the line as is, apart from case
+static inline bool keyFieldWhole(const KeyField *kf) {
+    return !kf->field && !kf->from && !kf->to && !kf->crlf && !kf->trim;
+}
+
+static inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Narrows a line down to its key in place, a line with too few fields or
+// bytes has an empty key. Folding case is left to the lookup.
+static inline void lineKey(const KeyField *kf, const char **line, size_t *len) {
+    const char *p = *line;
+    size_t n = *len;
+    if (kf->crlf && n > 0 && p[n - 1] == '\r')
+        --n;
+    if (kf->field) {
+        size_t start = kf->field > 1 ? findByte(p, n, kf->delim, kf->field - 2) + 1 : 0;
+        if (start > n)
+            start = n;
+        p += start;
+        n = findByte(p, n - start, kf->delim, 0);
+    }
+    if (kf->trim) {
+        while (n > 0 && isBlank(p[n - 1]))
+            --n;
+        while (n > 0 && isBlank(*p)) {
+            ++p;
+            --n;
+        }
+    }
+    size_t to = kf->to && kf->to < n ? kf->to : n;
+    size_t from = kf->from < to ? kf->from : to;
+    *line = p + from;
+    *len = to - from;
+}
+
+// Function to read all lines from a file and insert into the hash table.
+// The file has to lie in the key buffer of the set. If the set has masks,
+// the bits of mask are set for every line of the file. Only the part of a
+// line given by kf is its key, folded to lower case in the buffer itself if
+// kf says so, then the buffer has to be writable.
+// Returns the number of keys, duplicates included
+size_t hashFile(const char *filebuff, size_t buffsize, const KeyField *kf, KeySet *keySet, uint32_t mask) {
+    // The set grows as needed, so there is no need for a separate counting pass
+    LineScanner sc;
+    lineScannerInit(&sc, filebuff, buffsize, true);
+
+    const size_t base = filebuff - keySet->keys;
+    const bool whole = keyFieldWhole(kf);
+    size_t start = 0, keys = 0;
+    for (;;) {
+        size_t sep = nextLineSep(&sc);
+        const char *key = filebuff + start;
+        size_t len = sep - start;
+        if (!whole)
+            lineKey(kf, &key, &len);
+        if (kf->fold)
+            foldInPlace((char *)key, len);
+        if (len > 0) { // Skip empty lines, duplicates are only stored once
+            uint64_t hash = hashKey(key, len);
+            if (keySet->masks)
+                keySetInsertMask(keySet, base + (key - filebuff), len, hash, mask);
+            else
+                keySetInsert(keySet, base + (key - filebuff), len, hash);
+            ++keys;
+        }
+        if (sep >= buffsize)
+            return keys;
+        start = sep + 1;
+    }
+}
+
+// Building the hash set of big blacklist files on several threads. The
+// files are cut into line aligned pieces that are hashed at once, and the
+// keys of every piece are partitioned by the top bits of their tags. Those
+// bits pick a range of the slots, a shard, so the shards are filled at once
+// too, each one without locks and keeping the first of equal keys. Only
+// the keys whose slot run would leave their shard are inserted afterwards.
+
+#define SHARD_BITS 8
+#define SHARD_COUNT (1 << SHARD_BITS)
+#define SHARD_MIN_SLOTS 64          // Smaller shards would mostly overflow
+#define PARALLEL_MIN_BYTES (4 << 20) // Less is hashed by one thread
+#define PIECE_MIN_BYTES (1 << 20)
+
+typedef struct {
+    Slot slot;
+    uint32_t mask;
+} ShardEntry;
+
+// A line aligned piece of a file, its keys sorted by shard
+typedef struct {
+    const char *data;
+    size_t size;
+    uint32_t mask;      // Of the file
+    ShardEntry *entries;
+    size_t shard_start[SHARD_COUNT + 1];
+    size_t lines;       // Non-empty keys, duplicates included
+} ShardPiece;
+
+// The keys of a shard that did not fit into it
+typedef struct {
+    ShardEntry *entries;
+    size_t count;
+    size_t capacity;
+    size_t added;       // Keys that did fit, the duplicates not counted
+} ShardOverflow;
+
+typedef struct {
+    const char *keys;   // The buffer of all files
+    const KeyField *kf;
+    KeySet *set;
+    ShardPiece *pieces;
+    size_t piece_count;
+    ShardOverflow overflow[SHARD_COUNT];
+    _Atomic size_t next; // Piece, then shard, a thread takes next
+    _Atomic bool failed; // A worker printed an error, fail() is up to shardRun
+} ShardBuild;
+
+static inline size_t shardOf(uint32_t tag) {
+    return tag >> (32 - SHARD_BITS);
+}
+
+// hashFile of a piece into its entries, false if it ran out of memory
+static bool shardPieceHash(ShardPiece *piece, const char *keys, const KeyField *kf) {
+    LineScanner sc;
+    lineScannerInit(&sc, piece->data, piece->size, true);
+
+    size_t capacity = estimateLines(piece->data, piece->size) + 16, n = 0;
+    ShardEntry *hashed = malloc(capacity * sizeof(ShardEntry));
+    size_t counts[SHARD_COUNT] = { 0 };
+    const bool whole = keyFieldWhole(kf);
+    for (size_t start = 0; start <= piece->size;) {
+        size_t sep = nextLineSep(&sc);
+        const char *key = piece->data + start;
+        size_t len = sep - start;
+        start = sep + 1;
+        if (!whole)
+            lineKey(kf, &key, &len);
+        if (kf->fold)
+            foldInPlace((char *)key, len);
+        if (len == 0)
+            continue;
+        if (n == capacity)
+            hashed = realloc(hashed, (capacity *= 2) * sizeof(ShardEntry));
+        if (!hashed) {
+            perror("Error allocating memory");
+            return false;
+        }
+        uint32_t tag = hashTag(hashKey(key, len));
+        hashed[n++] = (ShardEntry) { .slot = makeSlot(key - keys, len, tag), .mask = piece->mask };
+        ++counts[shardOf(tag)];
+    }
+
+    // Radix partition by shard, the keys of a shard stay in file order
+    piece->entries = malloc((n ? n : 1) * sizeof(ShardEntry));
+    if (!hashed || !piece->entries) {
+        perror("Error allocating memory");
+        free(hashed);
+        return false;
+    }
+    piece->shard_start[0] = 0;
+    for (size_t s = 0; s < SHARD_COUNT; ++s)
+        piece->shard_start[s + 1] = piece->shard_start[s] + counts[s];
+    size_t at[SHARD_COUNT];
+    memcpy(at, piece->shard_start, sizeof(at));
+    for (size_t i = 0; i < n; ++i)
+        piece->entries[at[shardOf(hashed[i].slot.tag)]++] = hashed[i];
+    piece->lines = n;
+    free(hashed);
+    return true;
+}
+
+// keySetInsertMask of an entry into the shard of the set that ends before
+// slot end, without touching a slot of another shard. Returns false, and
+// leaves the set as it is, if the key is not there and has no room left.
+static bool keySetShardInsert(KeySet *set, const ShardEntry *entry, size_t end, size_t *added) {
+    size_t i = slotHome(set, entry->slot.tag);
+    for (size_t dist = 0; i < end; ++dist, ++i) {
+        const Slot *slot = &set->slots[i];
+        if (!slot->tag || i - slotHome(set, slot->tag) < dist)
+            break;
+        if (slot->tag == entry->slot.tag && slotLen(slot) == slotLen(&entry->slot)
+                && memcmp(set->keys + slot->off, set->keys + entry->slot.off, slotLen(slot)) == 0) {
+            if (set->masks)
+                set->masks[i] |= entry->mask;
+            return true;
+        }
+    }
+    // Placing it shifts the rest of the run up to the next empty slot
+    while (i < end && set->slots[i].tag)
+        ++i;
+    if (i == end)
+        return false;
+    keySetPlace(set, entry->slot, entry->mask);
+    ++*added;
+    return true;
+}
+
+// keySetInsertMask, or keySetInsert of a set without masks, of an entry
+static void keySetInsertEntry(KeySet *set, const ShardEntry *entry) {
+    const uint64_t hash = (uint64_t)entry->slot.tag << 32; // Has the same tag
+    if (set->masks)
+        keySetInsertMask(set, entry->slot.off, slotLen(&entry->slot), hash, entry->mask);
+    else
+        keySetInsert(set, entry->slot.off, slotLen(&entry->slot), hash);
+}
+
+// Fills a shard of the set, false if it ran out of memory
+static bool shardFill(ShardBuild *build, size_t shard) {
+    KeySet *set = build->set;
+    ShardOverflow *overflow = &build->overflow[shard];
+    const size_t end = (shard + 1) << (set->bits - SHARD_BITS);
+    for (size_t p = 0; p < build->piece_count; ++p) {
+        const ShardPiece *piece = &build->pieces[p];
+        for (size_t i = piece->shard_start[shard]; i < piece->shard_start[shard + 1]; ++i) {
+            if (keySetShardInsert(set, &piece->entries[i], end, &overflow->added))
+                continue;
+            if (overflow->count == overflow->capacity) {
+                overflow->capacity = overflow->capacity ? overflow->capacity * 2 : 64;
+                overflow->entries = realloc(overflow->entries, overflow->capacity * sizeof(ShardEntry));
+                if (!overflow->entries) {
+                    perror("Error allocating memory");
+                    return false;
+                }
+            }
+            overflow->entries[overflow->count++] = piece->entries[i];
+        }
+    }
+    return true;
+}
+
+static void *shardHashWorker(void *arg) {
+    ShardBuild *build = arg;
+    for (size_t i; !atomic_load(&build->failed) && (i = atomic_fetch_add(&build->next, 1)) < build->piece_count;)
+        if (!shardPieceHash(&build->pieces[i], build->keys, build->kf))
+            atomic_store(&build->failed, true);
+    return NULL;
+}
+
+static void *shardFillWorker(void *arg) {
+    ShardBuild *build = arg;
+    for (size_t s; !atomic_load(&build->failed) && (s = atomic_fetch_add(&build->next, 1)) < SHARD_COUNT;)
+        if (!shardFill(build, s))
+            atomic_store(&build->failed, true);
+    return NULL;
+}
+
+// Runs the worker on threads until it is done. Errors are only acted on
+// here, on the calling thread, where fail() can return to a failJump.
+static void shardRun(ShardBuild *build, void *(*worker)(void *), size_t threads) {
+    pthread_t ids[threads];
+    atomic_store(&build->next, 0);
+    size_t started = 0;
+    while (started < threads && pthread_create(&ids[started], NULL, worker, build) == 0)
+        ++started;
+    if (started == 0) // The workers take the work as it comes, so this one does all of it
+        worker(build);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(ids[i], NULL);
+    if (atomic_load(&build->failed))
+        fail();
+}
+
+// hashFile of every file on threads into a set keySetInit has not been
+// called for yet, sized for the keys found. Returns the number of keys,
+// duplicates included.
+size_t hashFilesParallel(const char *keys, const size_t *starts, const size_t *sizes, size_t count,
+                         const KeyField *kf, KeySet *set, size_t threads) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i)
+        total += sizes[i];
+    size_t piece_size = total / (threads * 4);
+    if (piece_size < PIECE_MIN_BYTES)
+        piece_size = PIECE_MIN_BYTES;
+
+    ShardBuild *build = calloc(1, sizeof(ShardBuild));
+    size_t piece_capacity = total / piece_size + count + 1;
+    ShardPiece *pieces = calloc(piece_capacity, sizeof(ShardPiece));
+    if (!build || !pieces) {
+        perror("Error allocating memory");
+        fail();
+    }
+    *build = (ShardBuild) { .keys = keys, .kf = kf, .set = set, .pieces = pieces };
+    for (size_t i = 0; i < count; ++i) {
+        const char *data = keys + starts[i];
+        for (size_t at = 0; at < sizes[i];) {
+            size_t end = at + piece_size < sizes[i] ? at + piece_size : sizes[i];
+            while (end < sizes[i] && !isLineSep(data[end - 1]))
+                ++end;
+            pieces[build->piece_count++] = (ShardPiece) { .data = data + at, .size = end - at, .mask = 1U << i };
+            at = end;
+        }
+    }
+    shardRun(build, shardHashWorker, threads < build->piece_count ? threads : build->piece_count);
+
+    size_t lines = 0;
+    for (size_t p = 0; p < build->piece_count; ++p)
+        lines += pieces[p].lines;
+    keySetInit(set, keys, lines);
+    if (count > 1)
+        keySetInitMasks(set);
+
+    if (((size_t)1 << set->bits) >= (size_t)SHARD_COUNT * SHARD_MIN_SLOTS) {
+        shardRun(build, shardFillWorker, threads);
+        for (size_t s = 0; s < SHARD_COUNT; ++s)
+            set->count += build->overflow[s].added;
+        for (size_t s = 0; s < SHARD_COUNT; ++s) {
+            for (size_t i = 0; i < build->overflow[s].count; ++i)
+                keySetInsertEntry(set, &build->overflow[s].entries[i]);
+            free(build->overflow[s].entries);
+        }
+    } else { // Too few keys to shard, they go in one at a time
+        for (size_t p = 0; p < build->piece_count; ++p)
+            for (size_t i = 0; i < pieces[p].lines; ++i)
+                keySetInsertEntry(set, &pieces[p].entries[i]);
+    }
+    for (size_t p = 0; p < build->piece_count; ++p)
+        free(pieces[p].entries);
+    free(pieces);
+    free(build);
+    return lines;
+}
+ 
+// Function to print the contents of the hash table
+void printKeySet(const KeySet *keySet) {
+    size_t cap = (size_t)1 << keySet->bits;
+    for (size_t i = 0; i < cap; ++i) {
+        const Slot *slot = &keySet->slots[i];
+        if (slot->tag) {
+            fputs("Key: ", stdout);
+            fwrite(keySet->keys + slot->off, 1, slotLen(slot), stdout);
+            putchar('\n');
+        }
+    }
+}
+
+#define BLOCK_SIZE (1 << 20)
+
+#define MPH_KEYS_PER_BUCKET 5
+#define MPH_MAX_PILOT UINT16_MAX
+#define MPH_MAX_SEEDS 64    // Tried before giving up, one nearly always does
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Maps a hash uniformly onto [0, n) without a division
+static inline uint64_t fastRange(uint64_t hash, uint64_t n) {
+    return (uint64_t)(((unsigned __int128)hash * n) >> 64);
+}
+
+// A perfect hash over a fixed set of keys, in the spirit of PTHash: keys
+// are spread over buckets and each bucket stores a 16 bit pilot that moves
+// all of its keys to free slots. A lookup reads one pilot and one slot.
+typedef struct {
+    const char *keys;
+    Slot *slots;
+    uint32_t *masks;    // Optional value per slot
+    uint16_t *pilots;
+    uint64_t slot_count;
+    uint64_t bucket_count;
+    uint64_t seed;
+    size_t count;
+    bool mapped;    // The arrays belong to a mapped index file
+} Mph;
+
+static inline size_t mphSlot(const Mph *mph, uint64_t hash) {
+    uint16_t pilot = mph->pilots[fastRange(hash, mph->bucket_count)];
+    return fastRange(mix64(hash ^ mph->seed ^ (pilot * 0x9e3779b97f4a7c15ULL)), mph->slot_count);
+}
+
+static inline const Slot *mphFind(const Mph *mph, const char *key, size_t len, uint64_t hash, bool fold) {
+    const Slot *slot = &mph->slots[mphSlot(mph, hash)];
+    if (slot->tag == hashTag(hash) && slotLen(slot) == len
+            && (fold ? foldEqual(mph->keys + slot->off, key, len) : memcmp(mph->keys + slot->off, key, len) == 0))
+        return slot;
+    return NULL;
+}
+
+typedef struct {
+    uint64_t hash;
+    Slot slot;
+    uint32_t mask;
+} MphKey;
+
+// Finds a pilot for every bucket, biggest buckets first. Returns false if
+// some bucket does not fit with this seed.
+static bool mphPlace(Mph *mph, const MphKey *keys, const size_t *bucket_start,
+                     const size_t *order, uint64_t *taken) {
+    size_t positions[64];
+
+    for (size_t o = 0; o < mph->bucket_count; ++o) {
+        size_t b = order[o];
+        size_t size = bucket_start[b + 1] - bucket_start[b];
+        if (size == 0)
+            break;
+        if (size > sizeof(positions) / sizeof(*positions))
+            return false;
+
+        const MphKey *bucket = &keys[bucket_start[b]];
+        bool placed = false;
+        for (uint32_t pilot = 0; pilot <= MPH_MAX_PILOT && !placed; ++pilot) {
+            mph->pilots[b] = pilot;
+            placed = true;
+            for (size_t k = 0; k < size && placed; ++k) {
+                size_t pos = mphSlot(mph, bucket[k].hash);
+                if (taken[pos / 64] >> (pos % 64) & 1)
+                    placed = false;
+                for (size_t j = 0; j < k && placed; ++j)
+                    if (positions[j] == pos)
+                        placed = false;
+                positions[k] = pos;
+            }
+        }
+        if (!placed)
+            return false;
+
+        for (size_t k = 0; k < size; ++k) {
+            taken[positions[k] / 64] |= 1ULL << (positions[k] % 64);
+            mph->slots[positions[k]] = bucket[k].slot;
+            if (mph->masks)
+                mph->masks[positions[k]] = bucket[k].mask;
+        }
+    }
+    return true;
+}
+
+void freeMph(Mph *mph) {
+    if (!mph->mapped) {
+        free(mph->slots);
+        free(mph->masks);
+        free(mph->pilots);
+    }
+    mph->slots = NULL;
+    mph->masks = NULL;
+    mph->pilots = NULL;
+}
+
+// Builds a perfect hash over the keys of the set, the set can be freed after.
+// Returns false if there is none, when keys share their whole hash or no
+// seed places them.
+bool mphBuild(Mph *mph, const KeySet *set) {
+    const size_t n = set->count;
+    const size_t cap = (size_t)1 << set->bits;
+
+    mph->keys = set->keys;
+    mph->count = n;
+    mph->mapped = false;
+    mph->bucket_count = n / MPH_KEYS_PER_BUCKET + 1;
+    mph->slot_count = n + n / 32 + 1;   // A few free slots make pilots easy to find
+
+    MphKey *unsorted = malloc((n + 1) * sizeof(MphKey));
+    MphKey *keys = malloc((n + 1) * sizeof(MphKey));
+    size_t *bucket_start = calloc(mph->bucket_count + 1, sizeof(size_t));
+    size_t *order = malloc(mph->bucket_count * sizeof(size_t));
+    uint64_t *taken = malloc((mph->slot_count / 64 + 1) * sizeof(uint64_t));
+    mph->slots = malloc(mph->slot_count * sizeof(Slot));
+    mph->masks = set->masks ? malloc(mph->slot_count * sizeof(uint32_t)) : NULL;
+    mph->pilots = malloc(mph->bucket_count * sizeof(uint16_t));
+    if (!unsorted || !keys || !bucket_start || !order || !taken || !mph->slots || !mph->pilots
+            || (set->masks && !mph->masks)) {
+        perror("Error allocating memory");
+        fail();
+    }
+
+    // Sort the keys by bucket
+    size_t k = 0;
+    for (size_t i = 0; i < cap; ++i) {
+        const Slot *slot = &set->slots[i];
+        if (slot->tag)
+            unsorted[k++] = (MphKey) {
+                .hash = hashKey(set->keys + slot->off, slotLen(slot)),
+                .slot = *slot,
+                .mask = set->masks ? set->masks[i] : 0,
+            };
+    }
+    for (size_t i = 0; i < n; ++i)
+        ++bucket_start[fastRange(unsorted[i].hash, mph->bucket_count) + 1];
+    for (size_t b = 0; b < mph->bucket_count; ++b)
+        bucket_start[b + 1] += bucket_start[b];
+    for (size_t i = 0; i < n; ++i) {
+        size_t b = fastRange(unsorted[i].hash, mph->bucket_count);
+        keys[bucket_start[b]++] = unsorted[i];
+    }
+    // Every start moved on to the next bucket while filling it
+    memmove(bucket_start + 1, bucket_start, mph->bucket_count * sizeof(size_t));
+    bucket_start[0] = 0;
+    free(unsorted);
+
+    // No pilot separates keys of the same hash, and the bucket of a key does
+    // not change with the seed. Sorting the few keys of a bucket finds them.
+    bool placed = true;
+    for (size_t b = 0; b < mph->bucket_count && placed; ++b) {
+        MphKey *bucket = &keys[bucket_start[b]];
+        size_t size = bucket_start[b + 1] - bucket_start[b];
+        placed = size <= 64;
+        for (size_t i = 1; i < size && placed; ++i) {
+            MphKey key = bucket[i];
+            size_t j = i;
+            for (; j > 0 && bucket[j - 1].hash > key.hash; --j)
+                bucket[j] = bucket[j - 1];
+            bucket[j] = key;
+        }
+        for (size_t i = 1; i < size && placed; ++i)
+            placed = bucket[i - 1].hash != bucket[i].hash;
+    }
+
+    // Order the buckets by size, biggest first
+    size_t size_count[65] = { 0 };
+    for (size_t b = 0; b < mph->bucket_count; ++b) {
+        size_t size = bucket_start[b + 1] - bucket_start[b];
+        ++size_count[size < 64 ? size : 64];
+    }
+    size_t size_start[66] = { 0 };
+    for (int s = 64; s >= 0; --s)
+        size_start[s] = size_start[s + 1] + size_count[s];
+    for (size_t b = 0; b < mph->bucket_count; ++b) {
+        size_t size = bucket_start[b + 1] - bucket_start[b];
+        order[size_start[(size < 64 ? size : 64) + 1]++] = b;
+    }
+
+    if (placed) {
+        placed = false;
+        for (uint64_t seed = 0; seed < MPH_MAX_SEEDS && !placed; ++seed) {
+            mph->seed = seed;
+            memset(taken, 0, (mph->slot_count / 64 + 1) * sizeof(uint64_t));
+            memset(mph->slots, 0, mph->slot_count * sizeof(Slot));
+            memset(mph->pilots, 0, mph->bucket_count * sizeof(uint16_t));
+            if (mph->masks)
+                memset(mph->masks, 0, mph->slot_count * sizeof(uint32_t));
+            placed = mphPlace(mph, keys, bucket_start, order, taken);
+        }
+    }
+
+    free(keys);
+    free(bucket_start);
+    free(order);
+    free(taken);
+    if (!placed)
+        freeMph(mph);
+    return placed;
+}
+
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_MAX_BITS 64   // Per key, more hardly lowers the false positives
+
+// Split block Bloom filter: every key sets one bit in each of the eight
+// 32 bit words of a single 32 byte block, so a test touches one cache line
+typedef struct {
+    uint32_t *words;
+    uint64_t block_count;   // 0 if there is no filter
+    bool mapped;            // The words belong to a mapped index file
+} Bloom;
+
+static const uint32_t bloomSalt[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+};
+
+static inline bool bloomMayContain(const Bloom *bloom, uint64_t hash) {
+    if (!bloom->block_count)
+        return true;
+    const uint32_t *block = &bloom->words[fastRange(hash, bloom->block_count) * BLOOM_BLOCK_WORDS];
+    uint32_t key = (uint32_t)hash;
+    uint32_t miss = 0;
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; ++i)
+        miss |= ~block[i] & (1U << ((key * bloomSalt[i]) >> 27));
+    return !miss;
+}
+
+static inline void bloomPrefetch(const Bloom *bloom, uint64_t hash) {
+    __builtin_prefetch(&bloom->words[fastRange(hash, bloom->block_count) * BLOOM_BLOCK_WORDS]);
+}
+
+static inline void bloomAdd(Bloom *bloom, uint64_t hash) {
+    uint32_t *block = &bloom->words[fastRange(hash, bloom->block_count) * BLOOM_BLOCK_WORDS];
+    uint32_t key = (uint32_t)hash;
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; ++i)
+        block[i] |= 1U << ((key * bloomSalt[i]) >> 27);
+}
+
+void bloomInit(Bloom *bloom, size_t count, size_t bits_per_key) {
+    size_t bits = count * bits_per_key;
+    bloom->block_count = bits / (32 * BLOOM_BLOCK_WORDS) + 1;
+    bloom->mapped = false;
+    bloom->words = calloc(bloom->block_count * BLOOM_BLOCK_WORDS, sizeof(uint32_t));
+    if (!bloom->words) {
+        perror("Error allocating memory");
+        fail();
+    }
+}
+
+void freeBloom(Bloom *bloom) {
+    if (!bloom->mapped)
+        free(bloom->words);
+    bloom->words = NULL;
+    bloom->block_count = 0;
+}
+
+// Bytes skip to skip + 8 of the key as a big endian number, padded with
+// zeros, so a smaller number means a smaller key and only equal numbers
+// need the keys compared
+static inline uint64_t prefixWord(const char *key, size_t len, size_t skip) {
+    uint64_t word = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (skip + 8 <= len) {
+        memcpy(&word, key + skip, 8);
+        return __builtin_bswap64(word);
+    }
+#endif
+    for (size_t i = skip; i < skip + 8; ++i)
+        word = word << 8 | (i < len ? (unsigned char)key[i] : 0);
+    return word;
+}
+
+// A key of a set, for the indices that need the keys in order
+typedef struct {
+    const char *key;
+    size_t len;
+    uint32_t mask;
+    uint32_t parent;    // Longest key that is a proper prefix, see Prefixes
+    uint64_t word;      // While sorting, see sortKeysAt
+} SortedKey;
+
+// Orders keys by the word of their bytes at depth, then the keys ending
+// within it by length, shorter first; 0 for two keys that go on after it
+static inline int compareSortedKeysAt(const SortedKey *a, const SortedKey *b, size_t depth) {
+    if (a->word != b->word)
+        return a->word < b->word ? -1 : 1;
+    size_t a_end = a->len < depth + 9 ? a->len : depth + 9;
+    size_t b_end = b->len < depth + 9 ? b->len : depth + 9;
+    return (a_end > b_end) - (a_end < b_end);
+}
+
+static void sortKeysFrom(SortedKey *keys, size_t n, size_t depth);
+
+// Multikey quicksort, 8 bytes at a time: partitions by the words at depth
+// and only goes deeper for the keys equal in them, so a long common prefix
+// is read once per key rather than once per comparison
+static void sortKeysAt(SortedKey *keys, size_t n, size_t depth) {
+    while (n > 1) {
+        SortedKey pivot = keys[n / 2];
+        size_t lt = 0, i = 0, gt = n;
+        while (i < gt) {
+            int c = compareSortedKeysAt(&keys[i], &pivot, depth);
+            SortedKey tmp = keys[i];
+            if (c < 0) {
+                keys[i++] = keys[lt];
+                keys[lt++] = tmp;
+            } else if (c > 0) {
+                keys[i] = keys[--gt];
+                keys[gt] = tmp;
+            } else {
+                ++i;
+            }
+        }
+        // Only keys going on can be equal, the keys are unique. The two
+        // smaller parts are sorted by recursion and the largest by the
+        // loop, so the stack is at most log2(n) deep.
+        const bool deeper = pivot.len > depth + 8;
+        const size_t less = lt, equal = deeper ? gt - lt : 0, more = n - gt;
+        if (less >= equal && less >= more) {
+            sortKeysAt(keys + gt, more, depth);
+            if (deeper)
+                sortKeysFrom(keys + lt, equal, depth + 8);
+            n = less;
+        } else if (more >= equal) {
+            sortKeysAt(keys, less, depth);
+            if (deeper)
+                sortKeysFrom(keys + lt, equal, depth + 8);
+            keys += gt;
+            n = more;
+        } else {
+            sortKeysAt(keys, less, depth);
+            sortKeysAt(keys + gt, more, depth);
+            keys += lt;
+            n = equal;
+            depth += 8;
+            for (size_t i = 0; i < n; ++i)
+                keys[i].word = prefixWord(keys[i].key, keys[i].len, depth);
+        }
+    }
+}
+
+static void sortKeysFrom(SortedKey *keys, size_t n, size_t depth) {
+    for (size_t i = 0; i < n; ++i)
+        keys[i].word = prefixWord(keys[i].key, keys[i].len, depth);
+    sortKeysAt(keys, n, depth);
+}
+
+// The keys of the set in byte order
+SortedKey *sortKeys(const KeySet *set) {
+    SortedKey *keys = malloc((set->count + 1) * sizeof(SortedKey));
+    if (!keys) {
+        perror("Error allocating memory");
+        fail();
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < (size_t)1 << set->bits; ++i) {
+        if (!set->slots[i].tag)
+            continue;
+        keys[n++] = (SortedKey) {
+            .key = set->keys + set->slots[i].off,
+            .len = slotLen(&set->slots[i]),
+            .mask = set->masks ? set->masks[i] : 1,
+        };
+    }
+    sortKeysFrom(keys, n, 0);
+    return keys;
+}
+
+// --substring looks the keys up with an Aho-Corasick automaton, a trie
+// stored as a double array: the child of state s for byte c is state base + c
+// of s, if that state's check is s. A byte without a child follows the
+// failure links, and the mask of a state includes the masks of the keys
+// ending in its suffixes, so matching costs a single OR per byte.
+typedef struct {
+    uint32_t base;
+    uint32_t check;     // Parent state, TRIE_FREE if unused
+    uint32_t fail;      // Longest proper suffix that is a state
+    uint32_t mask;      // Files of the keys matched in this state
+} TrieState;
+
+#define TRIE_FREE UINT32_MAX
+#define TRIE_SEARCH_LIMIT 256   // Unused states tried for a node before it goes to the end
+#define TRIE_ROOT_CHECK (UINT32_MAX - 1)
+
+typedef struct {
+    TrieState *states;
+    size_t state_count;     // Size of the array, not all are in use
+    size_t used;
+    size_t count;           // Keys
+    uint32_t all;           // Masks of all keys
+} Trie;
+
+// The trie before it is laid out, children are kept in byte order
+typedef struct {
+    uint32_t child;
+    uint32_t last_child;
+    uint32_t sibling;
+    uint32_t mask;
+    unsigned char byte;
+} TrieNode;
+
+// While the trie is laid out, its unused states form a list in order: base
+// links to the next one and fail to the one before, 0 is the end as the root
+// is never unused
+typedef struct {
+    Trie *trie;
+    uint32_t first_free;
+    uint32_t last_free;
+} TrieLayout;
+
+static void trieGrow(TrieLayout *layout, size_t size) {
+    Trie *trie = layout->trie;
+    if (size <= trie->state_count)
+        return;
+    size_t count = trie->state_count ? trie->state_count : 1024;
+    while (count < size)
+        count *= 2;
+    if (count > UINT32_MAX - 2) {
+        fprintf(stderr, "Error building the trie: too many states\n");
+        fail();
+    }
+    trie->states = realloc(trie->states, count * sizeof(TrieState));
+    if (!trie->states) {
+        perror("Error allocating memory");
+        fail();
+    }
+    for (size_t i = trie->state_count; i < count; ++i) {
+        if (i == 0)
+            continue;
+        trie->states[i] = (TrieState) { .check = TRIE_FREE, .fail = layout->last_free };
+        if (layout->last_free)
+            trie->states[layout->last_free].base = i;
+        else
+            layout->first_free = i;
+        layout->last_free = i;
+    }
+    trie->state_count = count;
+}
+
+// Takes an unused state out of the list
+static void trieUse(TrieLayout *layout, uint32_t s) {
+    TrieState *st = layout->trie->states;
+    uint32_t next = st[s].base;
+    uint32_t prev = st[s].fail;
+    if (prev)
+        st[prev].base = next;
+    else
+        layout->first_free = next;
+    if (next)
+        st[next].fail = prev;
+    else
+        layout->last_free = prev;
+}
+
+// Builds the automaton of the keys of the set
+void trieBuild(Trie *trie, const KeySet *set) {
+    *trie = (Trie) { .count = set->count };
+
+    // Inserting the keys in order only ever appends children, and a key
+    // shares the path of the one before it up to their common prefix
+    SortedKey *keys = sortKeys(set);
+    size_t n = set->count;
+    size_t max_len = 0;
+    for (size_t k = 0; k < n; ++k)
+        max_len = keys[k].len > max_len ? keys[k].len : max_len;
+
+    size_t node_capacity = 1024;
+    size_t node_count = 1;
+    TrieNode *nodes = calloc(node_capacity, sizeof(TrieNode));
+    uint32_t *path = malloc((max_len + 1) * sizeof(uint32_t));
+    if (!nodes || !path) {
+        perror("Error allocating memory");
+        fail();
+    }
+    path[0] = 0;
+    for (size_t k = 0; k < n; ++k) {
+        size_t common = 0;
+        if (k > 0)
+            while (common < keys[k - 1].len && common < keys[k].len
+                   && keys[k - 1].key[common] == keys[k].key[common])
+                ++common;
+        for (size_t d = common; d < keys[k].len; ++d) {
+            if (node_count > UINT32_MAX - 2) {
+                fprintf(stderr, "Error building the trie: too many states\n");
+                fail();
+            }
+            if (node_count == node_capacity) {
+                nodes = realloc(nodes, (node_capacity *= 2) * sizeof(TrieNode));
+                if (!nodes) {
+                    perror("Error allocating memory");
+                    fail();
+                }
+            }
+            uint32_t node = node_count++;
+            TrieNode *parent = &nodes[path[d]];
+            nodes[node] = (TrieNode) { .byte = keys[k].key[d] };
+            if (parent->child)
+                nodes[parent->last_child].sibling = node;
+            else
+                parent->child = node;
+            parent->last_child = node;
+            path[d + 1] = node;
+        }
+        nodes[path[keys[k].len]].mask |= keys[k].mask;
+        trie->all |= keys[k].mask;
+    }
+    free(path);
+    free(keys);
+
+    // Lay the nodes out breadth first, every node at the first base where
+    // all its children fit, or after all used states if none is found soon
+    uint32_t *order = malloc(node_count * sizeof(uint32_t));   // Nodes, breadth first
+    uint32_t *state = malloc(node_count * sizeof(uint32_t));   // Of each node
+    if (!order || !state) {
+        perror("Error allocating memory");
+        fail();
+    }
+    TrieLayout layout = { .trie = trie };
+    trieGrow(&layout, 256 + 1);
+    trie->states[0] = (TrieState) { .check = TRIE_ROOT_CHECK, .mask = nodes[0].mask };
+    trie->used = 1;
+    state[0] = 0;
+    order[0] = 0;
+    size_t max_base = 0;
+    size_t max_state = 0;
+    for (size_t head = 0, tail = 1; head < tail; ++head) {
+        const TrieNode *node = &nodes[order[head]];
+        if (!node->child)
+            continue;
+        unsigned char first = nodes[node->child].byte;
+
+        // Only unused states can take the first child
+        size_t base = max_state + 1;
+        uint32_t p = layout.first_free;
+        for (size_t tries = 0; p && tries < TRIE_SEARCH_LIMIT; p = trie->states[p].base, ++tries) {
+            if (p <= first)
+                continue;
+            trieGrow(&layout, p - first + 256 + 1);
+            bool fits = true;
+            for (uint32_t c = nodes[node->child].sibling; c && fits; c = nodes[c].sibling)
+                fits = trie->states[p - first + nodes[c].byte].check == TRIE_FREE;
+            if (fits) {
+                base = p - first;
+                break;
+            }
+        }
+        trieGrow(&layout, base + 256 + 1);
+
+        uint32_t s = state[order[head]];
+        trie->states[s].base = base;
+        max_base = base > max_base ? base : max_base;
+        for (uint32_t c = node->child; c; c = nodes[c].sibling) {
+            uint32_t t = base + nodes[c].byte;
+            trieUse(&layout, t);
+            trie->states[t] = (TrieState) { .check = s, .mask = nodes[c].mask };
+            max_state = t > max_state ? t : max_state;
+            state[c] = t;
+            order[tail++] = c;
+            ++trie->used;
+        }
+    }
+
+    // Failure links and their masks, a suffix is always handled before
+    TrieState *st = trie->states;
+    for (size_t i = 1; i < node_count; ++i) {
+        uint32_t t = state[order[i]];
+        uint32_t parent = st[t].check;
+        unsigned char c = t - st[parent].base;
+        uint32_t fail = 0;
+        for (uint32_t f = parent; f != 0;) {
+            f = st[f].fail;
+            if (st[st[f].base + c].check == f) {
+                fail = st[f].base + c;
+                break;
+            }
+        }
+        st[t].fail = fail;
+        st[t].mask |= st[fail].mask;
+    }
+    free(order);
+    free(state);
+    free(nodes);
+
+    // Unused states are only ever checked, their links are of no use now
+    trie->state_count = max_base + 256 + 1;
+    trie->states = realloc(trie->states, trie->state_count * sizeof(TrieState));
+}
+
+// The files of all keys the line contains, or with fold the line in lower case
+static inline uint32_t trieMatch(const Trie *trie, const char *line, size_t len, bool fold) {
+    const TrieState *st = trie->states;
+    uint32_t s = 0;
+    uint32_t mask = 0;
+    for (size_t i = 0; i < len && mask != trie->all; ++i) {
+        unsigned char c = fold ? foldByte(line[i]) : line[i];
+        for (;;) {
+            uint32_t t = st[s].base + c;
+            if (st[t].check == s) {
+                s = t;
+                break;
+            }
+            if (s == 0)
+                break;
+            s = st[s].fail;
+        }
+        mask |= st[s].mask;
+    }
+    return mask;
+}
+
+void freeTrie(Trie *trie) {
+    free(trie->states);
+    trie->states = NULL;
+}
+
+#define PREFIX_NONE UINT32_MAX
+
+// --prefix looks the keys up in order: the keys a line starts with are the
+// greatest key not after the line and the keys it starts with, as far as
+// they are within the common prefix of the two. Every key links to the
+// longest key it starts with and has the masks of all of them.
+//
+// Buckets by the first two bytes, and within a bucket by the first bits of
+// the 8 bytes after the common prefix of the bucket, narrow down the binary
+// search. It compares those 8 bytes, kept next to each other, before it has
+// to look at the keys themselves.
+typedef struct {
+    SortedKey *keys;
+    uint64_t *words;        // Of each key, see prefixWord
+    size_t count;
+    uint32_t *buckets;      // First key of each bucket and the end
+    uint32_t *skips;        // Common prefix of the keys of each bucket
+    uint32_t *radix_offs;   // Start of the radix table of each bucket
+    uint8_t *radix_bits;    // Bits of the words it is indexed by, 0 for none
+    uint32_t *radix;        // First key of each value of those bits and the end
+} Prefixes;
+
+#define PREFIX_RADIX_KEYS 4     // About the keys left to search per radix entry
+#define PREFIX_RADIX_MAX_BITS 20
+
+#define PREFIX_BUCKETS (1 << 16)
+
+static inline size_t prefixBucket(const char *key, size_t len, bool fold) {
+    unsigned char first = fold ? foldByte(key[0]) : key[0];
+    unsigned char second = len < 2 ? 0 : fold ? foldByte(key[1]) : key[1];
+    return (size_t)first << 8 | second;
+}
+
+// memcmp of a lower case key and the line, with fold the line in lower case
+static inline int compareFolded(const char *key, const char *line, size_t len, bool fold) {
+    if (!fold)
+        return memcmp(key, line, len);
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char a = key[i];
+        unsigned char b = foldByte(line[i]);
+        if (a != b)
+            return a < b ? -1 : 1;
+    }
+    return 0;
+}
+
+void prefixesBuild(Prefixes *prefixes, const KeySet *set) {
+    prefixes->keys = sortKeys(set);
+    prefixes->count = set->count;
+    prefixes->words = malloc((set->count + 1) * sizeof(uint64_t));
+    prefixes->buckets = malloc((PREFIX_BUCKETS + 1) * sizeof(uint32_t));
+    prefixes->skips = calloc(PREFIX_BUCKETS, sizeof(uint32_t));
+    prefixes->radix_offs = calloc(PREFIX_BUCKETS, sizeof(uint32_t));
+    prefixes->radix_bits = calloc(PREFIX_BUCKETS, sizeof(uint8_t));
+    uint32_t *chain = malloc((set->count + 1) * sizeof(uint32_t));
+    if (!prefixes->words || !prefixes->buckets || !prefixes->skips || !prefixes->radix_offs
+        || !prefixes->radix_bits || !chain) {
+        perror("Error allocating memory");
+        fail();
+    }
+
+    // The keys a key starts with are all on the chain of the key before it
+    size_t depth = 0;
+    for (size_t k = 0; k < prefixes->count; ++k) {
+        SortedKey *key = &prefixes->keys[k];
+        while (depth > 0) {
+            const SortedKey *top = &prefixes->keys[chain[depth - 1]];
+            if (top->len < key->len && memcmp(top->key, key->key, top->len) == 0)
+                break;
+            --depth;
+        }
+        key->parent = depth > 0 ? chain[depth - 1] : PREFIX_NONE;
+        if (key->parent != PREFIX_NONE)
+            key->mask |= prefixes->keys[key->parent].mask;
+        chain[depth++] = k;
+    }
+    free(chain);
+
+    size_t k = 0;
+    size_t radix_size = 0;
+    size_t radix_capacity = 0;
+    prefixes->radix = NULL;
+    for (size_t b = 0; b <= PREFIX_BUCKETS; ++b) {
+        size_t start = k;
+        while (k < prefixes->count && prefixBucket(prefixes->keys[k].key, prefixes->keys[k].len, false) <= b)
+            ++k;
+        prefixes->buckets[b] = start;
+        if (b == PREFIX_BUCKETS || start == k)
+            continue;
+
+        // Keys in order, the first and the last share what all share
+        const SortedKey *first = &prefixes->keys[start];
+        const SortedKey *last = &prefixes->keys[k - 1];
+        size_t skip = 0;
+        while (skip < first->len && skip < last->len && first->key[skip] == last->key[skip])
+            ++skip;
+        prefixes->skips[b] = skip;
+        for (size_t i = start; i < k; ++i)
+            prefixes->words[i] = prefixWord(prefixes->keys[i].key, prefixes->keys[i].len, skip);
+
+        // The words are in order as well
+        unsigned bits = 0;
+        while (bits < PREFIX_RADIX_MAX_BITS && ((size_t)PREFIX_RADIX_KEYS << (bits + 1)) <= k - start)
+            ++bits;
+        if (!bits)
+            continue;
+        size_t size = ((size_t)1 << bits) + 1;
+        if (radix_size + size > radix_capacity) {
+            radix_capacity = (radix_size + size) * 2;
+            prefixes->radix = realloc(prefixes->radix, radix_capacity * sizeof(uint32_t));
+            if (!prefixes->radix) {
+                perror("Error allocating memory");
+                fail();
+            }
+        }
+        prefixes->radix_offs[b] = radix_size;
+        prefixes->radix_bits[b] = bits;
+        size_t i = start;
+        for (size_t r = 0; r < size; ++r) {
+            while (i < k && (prefixes->words[i] >> (64 - bits)) < r)
+                ++i;
+            prefixes->radix[radix_size + r] = i;
+        }
+        radix_size += size;
+    }
+}
+
+// The files of all keys the line starts with
+// With fold the keys are lower case and the line is looked up in lower case
+static inline uint32_t prefixesMatch(const Prefixes *prefixes, const char *line, size_t len, bool fold) {
+    if (len == 0)
+        return 0;
+    // Greatest key not after the line, from the bucket of the line on down
+    size_t b = prefixBucket(line, len, fold);
+    size_t lo = prefixes->buckets[b];
+    size_t hi = prefixes->buckets[b + 1];
+    if (lo < hi) {
+        // A line that does not share the common prefix of the bucket is
+        // before or after all of its keys
+        size_t skip = prefixes->skips[b];
+        int c = -compareFolded(prefixes->keys[lo].key, line, len < skip ? len : skip, fold);
+        uint64_t word = prefixWord(line, len, skip);
+        if (fold)
+            word = foldWord(word);
+        if (c < 0 || (c == 0 && len < skip)) {
+            hi = lo;
+        } else if (c > 0) {
+            lo = hi;
+        } else if (prefixes->radix_bits[b]) {
+            // Keys before the range of the first bits of the word are before
+            // the line, those after it after the line
+            const uint32_t *radix = prefixes->radix + prefixes->radix_offs[b];
+            size_t r = word >> (64 - prefixes->radix_bits[b]);
+            lo = radix[r];
+            hi = radix[r + 1];
+        }
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            bool before = prefixes->words[mid] < word;
+            if (prefixes->words[mid] == word) {
+                const SortedKey *key = &prefixes->keys[mid];
+                c = compareFolded(key->key, line, key->len < len ? key->len : len, fold);
+                before = c < 0 || (c == 0 && key->len <= len);
+            }
+            if (before)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+    if (lo == 0)
+        return 0;
+
+    const SortedKey *key = &prefixes->keys[lo - 1];
+    size_t common = 0;
+    size_t max = key->len < len ? key->len : len;
+    while (common < max && key->key[common] == (fold ? foldByte(line[common]) : line[common]))
+        ++common;
+    uint32_t k = lo - 1;
+    while (k != PREFIX_NONE && prefixes->keys[k].len > common)
+        k = prefixes->keys[k].parent;
+    return k != PREFIX_NONE ? prefixes->keys[k].mask : 0;
+}
+
+void freePrefixes(Prefixes *prefixes) {
+    free(prefixes->keys);
+    free(prefixes->words);
+    free(prefixes->buckets);
+    free(prefixes->skips);
+    free(prefixes->radix_offs);
+    free(prefixes->radix_bits);
+    free(prefixes->radix);
+    prefixes->keys = NULL;
+}
+
+// The length of a key and 7 bytes in one word. Below 8 bytes they are the
+// key, so equal words are equal keys, above they mix its first, middle and
+// last 8 bytes, which tell apart paths that only differ in the middle.
+static inline uint64_t smallWord(const char *key, size_t len, bool fold) {
+    uint64_t w;
+    if (len >= 8) {
+        uint64_t mid = readWord(key + len / 2 - 4, fold);
+        uint64_t last = readWord(key + len - 8, fold);
+        w = readWord(key, fold) ^ (mid << 21 | mid >> 43) ^ (last << 42 | last >> 22);
+        w = (w ^ w >> 56) & 0x00ffffffffffffffULL;
+    } else if (len >= 4) {
+        w = readHalf(key, fold) | readHalf(key + len - 4, fold) << (len - 4) * 8;
+    } else {
+        w = len ? readShort(key, len, fold) : 0;
+    }
+    return w | (uint64_t)(len < 255 ? len : 255) << 56;
+}
+
+// Pads the words of a small set, no key has length 0 and other bytes
+#define SMALL_PAD (~0ULL >> 8)
+
+// A blacklist of a few keys, scanned instead of hashed: the word of a line
+// is compared with 4 words of keys at a time and only a key with the same
+// word is compared as a whole, if it is longer than its word.
+typedef struct {
+    uint64_t *words;    // smallWord of the keys, padded to a multiple of 4
+    Slot *slots;        // Where the keys are, in the order of the words
+    uint32_t *masks;    // Optional, same order
+    const char *keys;
+    size_t count;
+} SmallSet;
+
+// Bit i is set if words[i] is w, for 4 words
+static inline uint32_t smallMatch4(const uint64_t *words, uint64_t w) {
+#if defined(__AVX2__)
+    __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)words), _mm256_set1_epi64x(w));
+    return _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+#elif defined(__SSE2__)
+    // No 64 bit compare in SSE2, both halves of a word have to be equal
+    const __m128i needle = _mm_set1_epi64x(w);
+    __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)words), needle);
+    __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(words + 2)), needle);
+    lo = _mm_and_si128(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    hi = _mm_and_si128(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_movemask_pd(_mm_castsi128_pd(lo)) | _mm_movemask_pd(_mm_castsi128_pd(hi)) << 2;
+#else
+    return (words[0] == w) | (words[1] == w) << 1 | (words[2] == w) << 2 | (words[3] == w) << 3;
+#endif
+}
+
+// The files the key is in, 0 if it is in none
+static inline uint32_t smallSetMatch(const SmallSet *set, const char *key, size_t len, bool fold) {
+    const uint64_t w = smallWord(key, len, fold);
+    for (size_t i = 0; i < set->count; i += 4) {
+        for (uint32_t m = smallMatch4(set->words + i, w); m; m &= m - 1) {
+            size_t k = i + __builtin_ctz(m);
+            const Slot *slot = &set->slots[k];
+            if (len < 8 || (slotLen(slot) == len && (fold ? foldEqual(set->keys + slot->off, key, len)
+                                                      : memcmp(set->keys + slot->off, key, len) == 0)))
+                return set->masks ? set->masks[k] : 1;
+        }
+    }
+    return 0;
+}
+
+void smallSetBuild(SmallSet *small, const KeySet *set) {
+    const size_t cap = (size_t)1 << set->bits;
+    const size_t padded = (set->count + 3) & ~(size_t)3;
+    small->keys = set->keys;
+    small->count = set->count;
+    small->words = malloc((padded + 1) * sizeof(uint64_t));
+    small->slots = malloc((padded + 1) * sizeof(Slot));
+    small->masks = set->masks ? malloc((padded + 1) * sizeof(uint32_t)) : NULL;
+    if (!small->words || !small->slots || (set->masks && !small->masks)) {
+        perror("Error allocating memory");
+        fail();
+    }
+
+    size_t k = 0;
+    for (size_t i = 0; i < cap; ++i) {
+        const Slot *slot = &set->slots[i];
+        if (!slot->tag)
+            continue;
+        // The keys are already folded
+        small->words[k] = smallWord(set->keys + slot->off, slotLen(slot), false);
+        small->slots[k] = *slot;
+        if (small->masks)
+            small->masks[k] = set->masks[i];
+        ++k;
+    }
+    for (; k < padded; ++k)
+        small->words[k] = SMALL_PAD;
+}
+
+void freeSmallSet(SmallSet *small) {
+    free(small->words);
+    free(small->slots);
+    free(small->masks);
+    small->words = NULL;
+    small->count = 0;
+}
+
+// A blacklist of keys sorted by hash, looked up by a binary search without
+// branches. Its arrays have no free slots, unlike the ones of a hash table.
+typedef struct {
+    uint64_t *hashes;   // Ascending
+    Slot *slots;        // Where the keys are, in the order of their hashes
+    uint32_t *masks;    // Optional, same order
+    const char *keys;
+    size_t count;
+} SortedSet;
+
+// The files the key is in, 0 if it is in none
+static inline uint32_t sortedSetMatch(const SortedSet *set, const char *key, size_t len, uint64_t hash, bool fold) {
+    const uint64_t *base = set->hashes;
+    size_t n = set->count;
+    if (!n)
+        return 0;
+    // The first hash not below, the compare compiles to a conditional move
+    while (n > 1) {
+        size_t half = n / 2;
+        base = base[half] < hash ? base + half : base;
+        n -= half;
+    }
+    size_t i = base - set->hashes + (*base < hash);
+    for (; i < set->count && set->hashes[i] == hash; ++i) {
+        const Slot *slot = &set->slots[i];
+        if (slotLen(slot) == len && (fold ? foldEqual(set->keys + slot->off, key, len)
+                                      : memcmp(set->keys + slot->off, key, len) == 0))
+            return set->masks ? set->masks[i] : 1;
+    }
+    return 0;
+}
+
+void sortedSetBuild(SortedSet *sorted, const KeySet *set) {
+    const size_t n = set->count;
+    const size_t cap = (size_t)1 << set->bits;
+    sorted->keys = set->keys;
+    sorted->count = n;
+    sorted->hashes = malloc((n + 1) * sizeof(uint64_t));
+    sorted->slots = malloc((n + 1) * sizeof(Slot));
+    sorted->masks = set->masks ? malloc((n + 1) * sizeof(uint32_t)) : NULL;
+    size_t *bucket_start = calloc(n + 2, sizeof(size_t));
+    if (!sorted->hashes || !sorted->slots || (set->masks && !sorted->masks) || !bucket_start) {
+        perror("Error allocating memory");
+        fail();
+    }
+
+    // The hashes are uniform, so spread over a bucket per key by their top
+    // bits they are out of order only within a bucket, which an insertion
+    // sort fixes in about one move per key
+    for (size_t i = 0; i < cap; ++i)
+        if (set->slots[i].tag)
+            ++bucket_start[fastRange(hashKey(set->keys + set->slots[i].off, slotLen(&set->slots[i])), n) + 1];
+    for (size_t b = 0; b < n; ++b)
+        bucket_start[b + 1] += bucket_start[b];
+    for (size_t i = 0; i < cap; ++i) {
+        const Slot *slot = &set->slots[i];
+        if (!slot->tag)
+            continue;
+        uint64_t hash = hashKey(set->keys + slot->off, slotLen(slot));
+        size_t k = bucket_start[fastRange(hash, n)]++;
+        sorted->hashes[k] = hash;
+        sorted->slots[k] = *slot;
+        if (sorted->masks)
+            sorted->masks[k] = set->masks[i];
+    }
+    for (size_t i = 1; i < n; ++i) {
+        uint64_t hash = sorted->hashes[i];
+        Slot slot = sorted->slots[i];
+        uint32_t mask = sorted->masks ? sorted->masks[i] : 0;
+        size_t k = i;
+        for (; k > 0 && sorted->hashes[k - 1] > hash; --k) {
+            sorted->hashes[k] = sorted->hashes[k - 1];
+            sorted->slots[k] = sorted->slots[k - 1];
+            if (sorted->masks)
+                sorted->masks[k] = sorted->masks[k - 1];
+        }
+        sorted->hashes[k] = hash;
+        sorted->slots[k] = slot;
+        if (sorted->masks)
+            sorted->masks[k] = mask;
+    }
+    free(bucket_start);
+}
+
+void freeSortedSet(SortedSet *sorted) {
+    free(sorted->hashes);
+    free(sorted->slots);
+    free(sorted->masks);
+    sorted->hashes = NULL;
+    sorted->count = 0;
+}
+
+// A slot of an InlineSet, the key follows it up to the next slot if it fits,
+// else its offset in the keys buffer and its length do
+typedef struct {
+    uint32_t tag;   // As in Slot
+    uint32_t len;   // Low 32 bits of the length
+} InlineSlot;
+
+#define INLINE_MIN_SHIFT 5  // Slots of 32 bytes, keys up to 24
+#define INLINE_MAX_SHIFT 6  // A cache line, keys up to 56
+
+// A hash set laid out like KeySet whose slots hold short keys themselves, so
+// finding one reads a single cache line instead of the slot and then the key
+typedef struct {
+    const char *keys;   // Of the keys too long for their slot
+    char *slots;        // 1 << shift bytes each, aligned to their size
+    uint32_t *masks;    // Optional value per slot
+    uint32_t bits;      // log2 of the capacity
+    uint32_t shift;
+    size_t count;
+    size_t spilled;     // Keys too long for their slot
+} InlineSet;
+
+static inline const InlineSlot *inlineSlot(const InlineSet *set, size_t i) {
+    return (const InlineSlot *)(set->slots + (i << set->shift));
+}
+
+// Whether the zero padded key of a slot is the line, 16 bytes at a time. The
+// last block of the line is loaded as a whole if that stays within its page,
+// the bytes after the line are masked out.
+static inline bool inlineEqual(const char *key, const char *line, size_t len, bool fold) {
+#if defined(__SSE2__)
+    for (size_t i = 0; i < len; i += 16) {
+        size_t left = len - i;
+        __m128i v;
+        if (left >= 16 || ((uintptr_t)(line + i) & 4095) <= 4096 - 16) {
+            v = _mm_loadu_si128((const __m128i *)(line + i));
+        } else {
+            char block[16] = { 0 };
+            memcpy(block, line + i, left);
+            v = _mm_loadu_si128((const __m128i *)block);
+        }
+        int upper;
+        if (fold)
+            v = foldBlock(v, &upper);
+        int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_loadu_si128((const __m128i *)(key + i))));
+        int valid = left >= 16 ? 0xffff : (1 << left) - 1;
+        if ((equal & valid) != valid)
+            return false;
+    }
+    return true;
+#else
+    return fold ? foldEqual(key, line, len) : memcmp(key, line, len) == 0;
+#endif
+}
+
+// The files the key is in, 0 if it is in none
+static inline uint32_t inlineSetMatch(const InlineSet *set, const char *key, size_t len, uint64_t hash, bool fold) {
+    const size_t mask = ((size_t)1 << set->bits) - 1;
+    const size_t capacity = ((size_t)1 << set->shift) - sizeof(InlineSlot);
+    const uint32_t tag = hashTag(hash);
+
+    size_t i = tag >> (32 - set->bits);
+    for (size_t dist = 0;; ++dist, i = (i + 1) & mask) {
+        const InlineSlot *slot = inlineSlot(set, i);
+        // The key would have displaced any entry closer to its home slot
+        if (!slot->tag || ((i - (slot->tag >> (32 - set->bits))) & mask) < dist)
+            return 0;
+        if (slot->tag != tag || slot->len != (uint32_t)len)
+            continue;
+        const char *stored = (const char *)(slot + 1);
+        bool equal;
+        if (len <= capacity) {
+            equal = inlineEqual(stored, key, len, fold);
+        } else {
+            uint64_t spill[2];  // Offset and whole length
+            memcpy(spill, stored, sizeof(spill));
+            equal = spill[1] == len && (fold ? foldEqual(set->keys + spill[0], key, len)
+                                             : memcmp(set->keys + spill[0], key, len) == 0);
+        }
+        if (equal)
+            return set->masks ? set->masks[i] : 1;
+    }
+}
+
+// The smallest slots that hold most keys of the set, 0 if none does
+uint32_t inlineShift(const KeySet *set) {
+    size_t fit[INLINE_MAX_SHIFT + 1] = { 0 };
+    for (size_t i = 0; i < ((size_t)1 << set->bits); ++i) {
+        const Slot *slot = &set->slots[i];
+        for (uint32_t shift = INLINE_MIN_SHIFT; slot->tag && shift <= INLINE_MAX_SHIFT; ++shift)
+            fit[shift] += slotLen(slot) <= ((size_t)1 << shift) - sizeof(InlineSlot);
+    }
+    for (uint32_t shift = INLINE_MIN_SHIFT; shift <= INLINE_MAX_SHIFT; ++shift)
+        if (fit[shift] * 8 >= set->count * 7)
+            return shift;
+    return 0;
+}
+
+// Copies the set into slots of 1 << shift bytes, slot i of one is slot i of
+// the other, so the order Robin Hood hashing keeps them in still holds
+void inlineSetBuild(InlineSet *inlined, const KeySet *set, uint32_t shift) {
+    const size_t cap = (size_t)1 << set->bits;
+    const size_t size = (size_t)1 << shift;
+    const size_t capacity = size - sizeof(InlineSlot);
+    inlined->keys = set->keys;
+    inlined->bits = set->bits;
+    inlined->shift = shift;
+    inlined->count = set->count;
+    inlined->spilled = 0;
+    // inlineEqual may read 16 bytes from the last key on
+    inlined->slots = aligned_alloc(size, cap * size + size);
+    inlined->masks = set->masks ? malloc(cap * sizeof(uint32_t)) : NULL;
+    if (!inlined->slots || (set->masks && !inlined->masks)) {
+        perror("Error allocating memory");
+        fail();
+    }
+    memset(inlined->slots, 0, cap * size + size);
+    if (set->masks)
+        memcpy(inlined->masks, set->masks, cap * sizeof(uint32_t));
+
+    for (size_t i = 0; i < cap; ++i) {
+        const Slot *slot = &set->slots[i];
+        if (!slot->tag)
+            continue;
+        InlineSlot *to = (InlineSlot *)(inlined->slots + i * size);
+        size_t len = slotLen(slot);
+        *to = (InlineSlot) { .tag = slot->tag, .len = (uint32_t)len };
+        if (len <= capacity) {
+            memcpy(to + 1, set->keys + slot->off, len);
+        } else {
+            uint64_t spill[2] = { slot->off, len };
+            memcpy(to + 1, spill, sizeof(spill));
+            ++inlined->spilled;
+        }
+    }
+}
+
+void freeInlineSet(InlineSet *inlined) {
+    free(inlined->slots);
+    free(inlined->masks);
+    inlined->slots = NULL;
+    inlined->count = 0;
+}
+
+typedef enum {
+    INDEX_HASH = 0,
+    INDEX_MPH,
+    INDEX_TRIE,     // Only built in memory, never compiled
+    INDEX_PREFIX,   // Same
+    INDEX_SMALL,    // Same
+    INDEX_SORTED,   // Same
+    INDEX_INLINE,   // Same
+} IndexKind;
+
+static const char *const indexNames[] = {
+    "hash table", "perfect hash", "substring automaton", "prefix table", "small set", "sorted array",
+    "inline hash table",
+};
+
+typedef enum {
+    MATCH_EXACT = 0,
+    MATCH_SUBSTRING,
+    MATCH_PREFIX,
+} MatchMode;
+
+#define MAX_FILES 32
+
+// Which blacklist files a line has to be in, or not in, to count as listed.
+// Bit i of a mask stands for the i-th file.
+typedef struct {
+    uint32_t must;
+    uint32_t must_not;
+    uint32_t any;       // If not 0, at least one of these
+} Selection;
+
+static inline bool selectionMatch(const Selection *sel, uint32_t mask) {
+    return (mask & sel->must) == sel->must && !(mask & sel->must_not)
+        && (!sel->any || (mask & sel->any));
+}
+
+// Changes appended to a compiled index since it was compiled, see --add.
+// A key is in the mask of added for the files it was last added to, and in
+// the mask of removed for the files it was last removed from.
+typedef struct {
+    KeySet added;
+    KeySet removed;
+    FileBuffer log;     // The keys of both sets point into it
+    size_t records;
+} Delta;
+
+static inline uint64_t elapsedNanos(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000ULL + now.tv_nsec - since->tv_nsec;
+}
+
+// What loading the blacklist took, for --stats
+typedef struct {
+    uint64_t read_ns;       // readFiles, or mapping a compiled index and its delta log
+    uint64_t hash_ns;       // hashFile of every file
+    uint64_t index_ns;      // Turning the hash set into the index and the Bloom filter
+    size_t lines;           // Non-empty lines hashed, the ones not in the set were duplicates
+} LoadStats;
+
+// The blacklist as it is looked up while filtering
+typedef struct {
+    IndexKind kind;
+    KeySet set;     // INDEX_HASH
+    Mph mph;        // INDEX_MPH
+    Trie trie;      // INDEX_TRIE
+    Prefixes prefixes; // INDEX_PREFIX
+    SmallSet small; // INDEX_SMALL
+    SortedSet sorted; // INDEX_SORTED
+    InlineSet inlined; // INDEX_INLINE
+    Bloom bloom;    // Optional prefilter in front of either
+    Delta delta;    // Only on a compiled index, empty unless log.size
+    uint32_t file_count;
+    Selection select;
+    KeyField key;   // Of the lines looked up
+    LoadStats load;
+} Index;
+
+// The hash indexFind and deltaMask expect
+static inline uint64_t indexHash(const Index *index, const char *key, size_t len) {
+    return index->key.fold ? hashKeyFold(key, len) : hashKey(key, len);
+}
+
+static inline const Slot *indexFind(const Index *index, const char *key, size_t len, uint64_t hash) {
+    if (index->kind == INDEX_MPH)
+        return mphFind(&index->mph, key, len, hash, index->key.fold);
+    return keySetLookup(&index->set, key, len, hash, index->key.fold);
+}
+
+// The files the key of a slot found by indexFind is in
+static inline uint32_t indexMask(const Index *index, const Slot *slot) {
+    if (index->kind == INDEX_MPH)
+        return index->mph.masks ? index->mph.masks[slot - index->mph.slots] : 1;
+    return index->set.masks ? index->set.masks[slot - index->set.slots] : 1;
+}
+
+// The files a key is in after the delta log, given the files it is in
+// according to the index itself
+static inline uint32_t deltaMask(const Delta *delta, const char *key, size_t len, uint64_t hash, uint32_t mask,
+                                 bool fold) {
+    const Slot *slot = keySetLookup(&delta->added, key, len, hash, fold);
+    if (slot)
+        mask |= delta->added.masks[slot - delta->added.slots];
+    slot = keySetLookup(&delta->removed, key, len, hash, fold);
+    if (slot)
+        mask &= ~delta->removed.masks[slot - delta->removed.slots];
+    return mask;
+}
+
+// Starts loading the memory a lookup of the hash will touch first
+static inline void indexPrefetch(const Index *index, uint64_t hash) {
+    if (index->kind == INDEX_MPH)
+        __builtin_prefetch(&index->mph.pilots[fastRange(hash, index->mph.bucket_count)]);
+    else
+        __builtin_prefetch(&index->set.slots[slotHome(&index->set, hashTag(hash))]);
+}
+
+// Replaces the hash set of the index with a perfect hash of its keys
+void indexToMph(Index *index) {
+    if (!mphBuild(&index->mph, &index->set)) {
+        fprintf(stderr, "WARNING: no perfect hash found for the keys, using a hash table\n");
+        return;
+    }
+    freeKeySet(&index->set);
+    index->kind = INDEX_MPH;
+}
+
+// Replaces the hash set of the index with the index of a match mode
+void indexToMatch(Index *index, MatchMode match) {
+    if (match == MATCH_SUBSTRING) {
+        trieBuild(&index->trie, &index->set);
+        index->kind = INDEX_TRIE;
+    } else {
+        prefixesBuild(&index->prefixes, &index->set);
+        index->kind = INDEX_PREFIX;
+    }
+    freeKeySet(&index->set);
+}
+
+// Up to how many keys an exact match index is a small set or a sorted array
+// when loadIndex picks it, see indexChoose. Filtering paths of 35 bytes, the
+// small set is the fastest up to about 32 keys and the sorted array keeps up
+// with the hash table up to about 2000.
+#define SMALL_MAX_KEYS 32
+#define SORTED_MAX_KEYS 1024
+
+// The exact match index that suits the keys of the set best. Scanning a few
+// keys beats hashing the line as long as their words hardly ever collide,
+// as they would for long keys that only differ in a few bytes.
+IndexKind indexChoose(const KeySet *set) {
+    if (set->count <= SMALL_MAX_KEYS) {
+        uint64_t words[SMALL_MAX_KEYS];
+        size_t n = 0, same = 0;
+        for (size_t i = 0; i < ((size_t)1 << set->bits); ++i)
+            if (set->slots[i].tag)
+                words[n++] = smallWord(set->keys + set->slots[i].off, slotLen(&set->slots[i]), false);
+        for (size_t i = 0; i < n; ++i)
+            for (size_t j = 0; j < i; ++j)
+                same += words[i] == words[j];
+        if (same * 8 <= n)
+            return INDEX_SMALL;
+    }
+    return set->count <= SORTED_MAX_KEYS ? INDEX_SORTED : INDEX_HASH;
+}
+
+// Replaces the hash set of the index with a small set or a sorted array
+void indexToKind(Index *index, IndexKind kind) {
+    if (kind == INDEX_SMALL)
+        smallSetBuild(&index->small, &index->set);
+    else if (kind == INDEX_SORTED)
+        sortedSetBuild(&index->sorted, &index->set);
+    else if (kind == INDEX_INLINE) // Of --index inline the keys may not fit
+        inlineSetBuild(&index->inlined, &index->set, inlineShift(&index->set) ? inlineShift(&index->set) : INLINE_MAX_SHIFT);
+    else
+        return;
+    freeKeySet(&index->set);
+    index->kind = kind;
+}
+
+// Puts a Bloom filter of the keys in front of the index
+void indexAddBloom(Index *index, size_t bits_per_key) {
+    const KeySet *set = &index->set;
+    const Slot *slots = set->slots;
+    const char *keys = set->keys;
+    size_t slot_count = (size_t)1 << set->bits;
+    if (index->kind == INDEX_MPH) {
+        slots = index->mph.slots;
+        keys = index->mph.keys;
+        slot_count = index->mph.slot_count;
+    }
+
+    bloomInit(&index->bloom, index->kind == INDEX_MPH ? index->mph.count : set->count, bits_per_key);
+    for (size_t i = 0; i < slot_count; ++i)
+        if (slots[i].tag)
+            bloomAdd(&index->bloom, hashKey(keys + slots[i].off, slotLen(&slots[i])));
+}
+
+size_t indexKeyCount(const Index *index) {
+    if (index->kind == INDEX_TRIE)
+        return index->trie.count;
+    if (index->kind == INDEX_PREFIX)
+        return index->prefixes.count;
+    if (index->kind == INDEX_SMALL)
+        return index->small.count;
+    if (index->kind == INDEX_SORTED)
+        return index->sorted.count;
+    if (index->kind == INDEX_INLINE)
+        return index->inlined.count;
+    return index->kind == INDEX_MPH ? index->mph.count : index->set.count;
+}
+
+// Memory of the slots or words of an exact match index, the keys not counted
+size_t indexBytes(const Index *index) {
+    const size_t mask = index->file_count > 1 ? sizeof(uint32_t) : 0;
+    switch (index->kind) {
+    case INDEX_HASH:
+        return ((size_t)1 << index->set.bits) * (sizeof(Slot) + mask);
+    case INDEX_MPH:
+        return index->mph.slot_count * (sizeof(Slot) + mask) + index->mph.bucket_count * sizeof(uint16_t);
+    case INDEX_SMALL:
+        return ((index->small.count + 3) & ~(size_t)3) * (sizeof(uint64_t) + sizeof(Slot) + mask);
+    case INDEX_SORTED:
+        return index->sorted.count * (sizeof(uint64_t) + sizeof(Slot) + mask);
+    case INDEX_INLINE:
+        return ((size_t)1 << index->inlined.bits) * (((size_t)1 << index->inlined.shift) + mask);
+    default:
+        return 0;
+    }
+}
+
+void freeIndex(Index *index) {
+    if (index->kind == INDEX_MPH)
+        freeMph(&index->mph);
+    else if (index->kind == INDEX_TRIE)
+        freeTrie(&index->trie);
+    else if (index->kind == INDEX_PREFIX)
+        freePrefixes(&index->prefixes);
+    else if (index->kind == INDEX_SMALL)
+        freeSmallSet(&index->small);
+    else if (index->kind == INDEX_SORTED)
+        freeSortedSet(&index->sorted);
+    else if (index->kind == INDEX_INLINE)
+        freeInlineSet(&index->inlined);
+    else
+        freeKeySet(&index->set);
+    freeBloom(&index->bloom);
+    if (index->delta.log.size) {
+        freeKeySet(&index->delta.added);
+        freeKeySet(&index->delta.removed);
+        freeFileBuffer(&index->delta.log);
+    }
+}
+
+// Checksum of compiled indices, FNV-1a so it can be computed piecewise
+uint64_t checksumUpdate(uint64_t sum, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; ++i) {
+        sum ^= p[i];
+        sum *= 0x100000001b3ULL;
+    }
+    return sum;
+}
+
+#define CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+#define BLX_MAGIC "BLXINDEX"
+#define BLX_VERSION 6     // 6: slots have 48 bit offsets and lengths
+#define BLX_BYTE_ORDER 0x01020304
+#define BLX_ALIGN 64
+
+#define BLX_FOLD_CASE 1     // Keys are lower case, see KeyField
+#define BLX_HASH_SHIFT 8    // The flags from this bit on are the HashKind
+
+// A compiled blacklist is this header followed by the slot table, the file
+// masks of the slots, the pilots of a perfect hash index, the Bloom filter
+// and the string pool. Slot offsets are
+// relative to the pool, so the file can be mapped anywhere and used as is.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;    // BLX_BYTE_ORDER as written by the compiling machine
+    uint64_t file_size;
+    uint32_t kind;          // IndexKind
+    uint32_t bits;          // log2 of the slot count of a hash index
+    uint32_t file_count;    // Masks are only stored for more than one file
+    uint32_t flags;         // BLX_FOLD_CASE and the hash, see BLX_HASH_SHIFT
+    uint64_t key_count;
+    uint64_t slot_count;
+    uint64_t slots_off;     // File offset of the slot table
+    uint64_t masks_off;
+    uint64_t bucket_count;  // Pilots of a perfect hash index
+    uint64_t pilots_off;
+    uint64_t seed;
+    uint64_t bloom_blocks;  // Optional Bloom filter
+    uint64_t bloom_off;
+    uint64_t pool_off;      // File offset of the string pool
+    uint64_t pool_size;
+    uint64_t data_checksum; // Of everything after the header
+    uint64_t header_checksum; // Of the header up to this field
+} BlxHeader;
+
+static inline uint64_t blxAlign(uint64_t off) {
+    return (off + BLX_ALIGN - 1) / BLX_ALIGN * BLX_ALIGN;
+}
+
+static bool isIndexFile(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    char magic[sizeof(BLX_MAGIC) - 1];
+    bool index = pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+        && memcmp(magic, BLX_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    return index;
+}
+
+static void writeAll(FILE *out, const void *data, size_t size, uint64_t *sum) {
+    if (fwrite(data, 1, size, out) != size) {
+        perror("Error writing index");
+        fail();
+    }
+    if (sum)
+        *sum = checksumUpdate(*sum, data, size);
+}
+
+static void writePadding(FILE *out, uint64_t *pos, uint64_t to, uint64_t *sum) {
+    static const char zeros[BLX_ALIGN];
+    writeAll(out, zeros, to - *pos, sum);
+    *pos = to;
+}
+
+// What compileIndex holds while it writes
+typedef struct {
+    Slot *slots;
+    char *tmpname;
+    FILE *out;
+} CompileState;
+
+static void releaseCompile(void *arg) {
+    CompileState *state = arg;
+    if (state->out) { // Failed while writing, nothing of it is kept
+        fclose(state->out);
+        unlink(state->tmpname);
+    }
+    free(state->tmpname);
+    free(state->slots);
+}
+
+// Serializes the index, the keys are copied into a compact pool
+void compileIndex(const Index *index, const char *filename) {
+    const char *keys;
+    const Slot *src;
+    const uint32_t *masks;
+    BlxHeader header = {
+        .version = BLX_VERSION,
+        .byte_order = BLX_BYTE_ORDER,
+        .kind = index->kind,
+        .file_count = index->file_count,
+        .flags = (index->key.fold ? BLX_FOLD_CASE : 0) | (uint32_t)keyHash << BLX_HASH_SHIFT,
+        .bloom_blocks = index->bloom.block_count,
+    };
+    memcpy(header.magic, BLX_MAGIC, sizeof(header.magic));
+
+    if (index->kind == INDEX_MPH) {
+        keys = index->mph.keys;
+        src = index->mph.slots;
+        masks = index->mph.masks;
+        header.key_count = index->mph.count;
+        header.slot_count = index->mph.slot_count;
+        header.bucket_count = index->mph.bucket_count;
+        header.seed = index->mph.seed;
+    } else {
+        keys = index->set.keys;
+        src = index->set.slots;
+        masks = index->set.masks;
+        header.key_count = index->set.count;
+        header.slot_count = (size_t)1 << index->set.bits;
+        header.bits = index->set.bits;
+    }
+
+    CompileState state = { .slots = malloc(header.slot_count * sizeof(Slot)) };
+    Slot *slots = state.slots;
+    if (!slots) {
+        perror("Error allocating memory");
+        fail();
+    }
+    FailCleanup cleanup;
+    failPush(&cleanup, releaseCompile, &state);
+    for (size_t i = 0; i < header.slot_count; ++i) {
+        slots[i] = src[i];
+        if (slots[i].tag) {
+            slots[i].off = header.pool_size;
+            header.pool_size += slotLen(&slots[i]);
+        }
+    }
+    const uint64_t masks_size = masks ? header.slot_count * sizeof(uint32_t) : 0;
+    header.slots_off = blxAlign(sizeof(BlxHeader));
+    header.masks_off = blxAlign(header.slots_off + header.slot_count * sizeof(Slot));
+    header.pilots_off = blxAlign(header.masks_off + masks_size);
+    header.bloom_off = blxAlign(header.pilots_off + header.bucket_count * sizeof(uint16_t));
+    header.pool_off = blxAlign(header.bloom_off + header.bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t));
+    header.file_size = header.pool_off + header.pool_size;
+
+    // Write next to the target and rename, so readers never see half a file
+    size_t tmplen = strlen(filename) + 32;
+    char *tmpname = state.tmpname = malloc(tmplen);
+    if (!tmpname) {
+        perror("Error allocating memory");
+        fail();
+    }
+    snprintf(tmpname, tmplen, "%s.tmp%ld", filename, (long)getpid());
+    FILE *out = state.out = fopen(tmpname, "wb");
+    if (!out) {
+        perror("Error creating index");
+        fail();
+    }
+
+    uint64_t sum = CHECKSUM_INIT;
+    uint64_t pos = sizeof(header);
+    writeAll(out, &header, sizeof(header), NULL);
+    writePadding(out, &pos, header.slots_off, &sum);
+    writeAll(out, slots, header.slot_count * sizeof(Slot), &sum);
+    pos += header.slot_count * sizeof(Slot);
+    writePadding(out, &pos, header.masks_off, &sum);
+    if (masks) {
+        writeAll(out, masks, masks_size, &sum);
+        pos += masks_size;
+    }
+    writePadding(out, &pos, header.pilots_off, &sum);
+    if (index->kind == INDEX_MPH) {
+        writeAll(out, index->mph.pilots, header.bucket_count * sizeof(uint16_t), &sum);
+        pos += header.bucket_count * sizeof(uint16_t);
+    }
+    writePadding(out, &pos, header.bloom_off, &sum);
+    if (header.bloom_blocks) {
+        writeAll(out, index->bloom.words, header.bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t), &sum);
+        pos += header.bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t);
+    }
+    writePadding(out, &pos, header.pool_off, &sum);
+    for (size_t i = 0; i < header.slot_count; ++i)
+        if (src[i].tag)
+            writeAll(out, keys + src[i].off, slotLen(&src[i]), &sum);
+
+    header.data_checksum = sum;
+    header.header_checksum = checksumUpdate(CHECKSUM_INIT, &header, offsetof(BlxHeader, header_checksum));
+    if (fseek(out, 0, SEEK_SET) != 0) {
+        perror("Error writing index");
+        fail();
+    }
+    writeAll(out, &header, sizeof(header), NULL);
+
+    state.out = NULL;
+    if (fclose(out) != 0 || rename(tmpname, filename) != 0) {
+        perror("Error writing index");
+        unlink(tmpname);
+        fail();
+    }
+    failPop(&cleanup);
+    releaseCompile(&state);
+}
+
+static void indexError(const char *filename, const char *what) {
+    fprintf(stderr, "Error loading index %s: %s\n", filename, what);
+    fail();
+}
+
+// Maps a compiled index, nothing is read or built until lookups touch it.
+// With verify the whole file is checksummed first.
+void mapIndex(const char *filename, FileBuffer *file, Index *index, bool verify) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Error opening file");
+        if (fd >= 0)
+            close(fd);
+        fail();
+    }
+    if ((size_t)st.st_size < sizeof(BlxHeader)) {
+        close(fd);
+        indexError(filename, "truncated header");
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Error mapping file");
+        close(fd);
+        fail();
+    }
+    close(fd);
+    file->data = data;
+    file->size = st.st_size;
+    file->mapped = true;
+
+    const BlxHeader *header = data;
+    if (header->version != BLX_VERSION)
+        indexError(filename, "unsupported version, recompile it");
+    if (header->byte_order != BLX_BYTE_ORDER)
+        indexError(filename, "compiled on a machine with a different byte order");
+    if (header->header_checksum != checksumUpdate(CHECKSUM_INIT, header, offsetof(BlxHeader, header_checksum)))
+        indexError(filename, "header checksum mismatch");
+    if (header->flags >> BLX_HASH_SHIFT != keyHash) // See blxHashSelect
+        indexError(filename, "compiled with another hash");
+
+    // The sizes are bounded first, so the offsets below cannot overflow
+    bool valid = header->file_size == (uint64_t)st.st_size
+        && header->slot_count <= header->file_size / sizeof(Slot)
+        && header->bucket_count <= header->file_size / sizeof(uint16_t)
+        && header->bloom_blocks <= header->file_size / (BLOOM_BLOCK_WORDS * sizeof(uint32_t))
+        && header->pool_size <= header->file_size
+        && header->file_count >= 1 && header->file_count <= MAX_FILES
+        && header->slots_off == blxAlign(sizeof(BlxHeader))
+        && header->masks_off == blxAlign(header->slots_off + header->slot_count * sizeof(Slot))
+        && header->pilots_off == blxAlign(header->masks_off
+                + (header->file_count > 1 ? header->slot_count * sizeof(uint32_t) : 0))
+        && header->bloom_off == blxAlign(header->pilots_off + header->bucket_count * sizeof(uint16_t))
+        && header->pool_off == blxAlign(header->bloom_off + header->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t))
+        && header->pool_off + header->pool_size == header->file_size;
+    if (header->kind == INDEX_HASH)
+        valid = valid && header->bits >= KEYSET_MIN_BITS && header->bits <= KEYSET_MAX_BITS
+            && header->slot_count == (uint64_t)1 << header->bits;
+    else if (header->kind == INDEX_MPH)
+        valid = valid && header->slot_count > 0 && header->bucket_count > 0;
+    else
+        valid = false;
+    if (!valid)
+        indexError(filename, "corrupt layout");
+
+    // Lookups trust the slots, so every key has to be within the pool, with
+    // or without --verify
+    const Slot *file_slots = (const Slot *)((const char *)data + header->slots_off);
+    const uint32_t *file_masks = header->file_count > 1
+        ? (const uint32_t *)((const char *)data + header->masks_off) : NULL;
+    const uint32_t all_files = (uint32_t)(((uint64_t)1 << header->file_count) - 1);
+    uint64_t occupied = 0;
+    for (uint64_t i = 0; i < header->slot_count; ++i) {
+        const Slot *slot = &file_slots[i];
+        if (!slot->tag)
+            continue;
+        if (slot->off > header->pool_size || slotLen(slot) > header->pool_size - slot->off
+                || (file_masks && (file_masks[i] & ~all_files)))
+            indexError(filename, "corrupt slots");
+        ++occupied;
+    }
+    if (occupied != header->key_count)
+        indexError(filename, "corrupt slots");
+
+    if (verify && header->data_checksum != checksumUpdate(CHECKSUM_INIT,
+                (const char *)data + sizeof(BlxHeader), st.st_size - sizeof(BlxHeader)))
+        indexError(filename, "data checksum mismatch");
+
+    madvise(data, st.st_size, MADV_RANDOM);
+
+    const char *keys = (const char *)data + header->pool_off;
+    Slot *slots = (Slot *)((char *)data + header->slots_off);
+    uint32_t *masks = header->file_count > 1 ? (uint32_t *)((char *)data + header->masks_off) : NULL;
+    index->kind = header->kind;
+    index->file_count = header->file_count;
+    index->key.fold = header->flags & BLX_FOLD_CASE;
+    index->bloom = (Bloom) {
+        .words = (uint32_t *)((char *)data + header->bloom_off),
+        .block_count = header->bloom_blocks,
+        .mapped = true,
+    };
+    if (header->kind == INDEX_MPH) {
+        index->mph = (Mph) {
+            .keys = keys,
+            .slots = slots,
+            .masks = masks,
+            .pilots = (uint16_t *)((char *)data + header->pilots_off),
+            .slot_count = header->slot_count,
+            .bucket_count = header->bucket_count,
+            .seed = header->seed,
+            .count = header->key_count,
+            .mapped = true,
+        };
+    } else {
+        index->set = (KeySet) {
+            .keys = keys,
+            .slots = slots,
+            .masks = masks,
+            .bits = header->bits,
+            .count = header->key_count,
+            .mapped = true,
+        };
+    }
+}
+
+#define DELTA_MAGIC "BLXDELTA"
+#define DELTA_VERSION 1
+
+enum { DELTA_ADD = 1, DELTA_REMOVE = 2 };
+
+// The delta log of a compiled index is the file next to it with ".delta"
+// appended: this header, then records that are only ever appended, each
+// followed by its key padded to 8 bytes
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t base_checksum;     // data_checksum of the index it applies to
+} DeltaHeader;
+
+typedef struct {
+    uint32_t op;
+    uint32_t mask;      // Files of the index the key is added to or removed from
+    uint64_t len;
+    uint64_t checksum;  // Of the fields above and the key
+} DeltaRecord;
+
+static char *deltaPath(const char *filename) {
+    size_t len = strlen(filename) + sizeof(".delta");
+    char *path = malloc(len);
+    if (!path) {
+        perror("Error allocating memory");
+        fail();
+    }
+    snprintf(path, len, "%s.delta", filename);
+    return path;
+}
+
+static inline size_t deltaPadded(uint64_t len) {
+    return (len + 7) & ~(uint64_t)7;
+}
+
+static uint64_t deltaChecksum(const DeltaRecord *rec, const char *key) {
+    uint64_t sum = checksumUpdate(CHECKSUM_INIT, rec, offsetof(DeltaRecord, checksum));
+    return checksumUpdate(sum, key, rec->len);
+}
+
+// Reads and checks the header of a compiled index without mapping it
+void readIndexHeader(const char *filename, BlxHeader *header) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        fail();
+    }
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header))
+        indexError(filename, "truncated header");
+    close(fd);
+    if (header->version != BLX_VERSION)
+        indexError(filename, "unsupported version, recompile it");
+    if (header->byte_order != BLX_BYTE_ORDER)
+        indexError(filename, "compiled on a machine with a different byte order");
+    if (header->header_checksum != checksumUpdate(CHECKSUM_INIT, header, offsetof(BlxHeader, header_checksum)))
+        indexError(filename, "header checksum mismatch");
+    if (header->flags >> BLX_HASH_SHIFT >= HASH_COUNT)
+        indexError(filename, "unsupported hash, recompile it");
+}
+
+// Selects the hash a compiled index was built with, it has to be in use
+// before the index is mapped
+void blxHashSelect(const char *filename) {
+    BlxHeader header;
+    readIndexHeader(filename, &header);
+    keyHash = header.flags >> BLX_HASH_SHIFT;
+}
+
+// Loads the delta log of a compiled index, if it has one. A torn record at
+// the end, from an append that did not finish, is ignored.
+void loadDelta(const char *filename, uint64_t base_checksum, Index *index) {
+    char *path = deltaPath(filename);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Error opening file %s: %s\n", path, strerror(errno));
+            fail();
+        }
+        free(path);
+        return;
+    }
+    if ((size_t)st.st_size < sizeof(DeltaHeader))
+        indexError(path, "truncated header");
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Error mapping file");
+        fail();
+    }
+    close(fd);
+
+    const DeltaHeader *header = (const DeltaHeader *)data;
+    if (memcmp(header->magic, DELTA_MAGIC, sizeof(header->magic)) != 0 || header->version != DELTA_VERSION
+        || header->byte_order != BLX_BYTE_ORDER)
+        indexError(path, "not a delta log of this version");
+    if (header->base_checksum != base_checksum) { // Left over from a compaction
+        fprintf(stderr, "WARNING: %s: belongs to another version of the index, ignored\n", path);
+        munmap(data, st.st_size);
+        free(path);
+        return;
+    }
+
+    Delta *delta = &index->delta;
+    delta->log = (FileBuffer) { .data = data, .size = st.st_size, .mapped = true };
+    keySetInit(&delta->added, data, 0);
+    keySetInitMasks(&delta->added);
+    keySetInit(&delta->removed, data, 0);
+    keySetInitMasks(&delta->removed);
+
+    size_t off = sizeof(DeltaHeader);
+    while (off + sizeof(DeltaRecord) <= (size_t)st.st_size) {
+        DeltaRecord rec;
+        memcpy(&rec, data + off, sizeof(rec));
+        size_t key = off + sizeof(rec);
+        if (rec.len > st.st_size - key || (rec.op != DELTA_ADD && rec.op != DELTA_REMOVE)
+            || deltaChecksum(&rec, data + key) != rec.checksum)
+            break;
+
+        // The latest change of a file wins
+        uint64_t hash = hashKey(data + key, rec.len);
+        KeySet *to = rec.op == DELTA_ADD ? &delta->added : &delta->removed;
+        KeySet *from = rec.op == DELTA_ADD ? &delta->removed : &delta->added;
+        keySetInsertMask(to, key, rec.len, hash, rec.mask);
+        const Slot *slot = keySetFind(from, data + key, rec.len, hash);
+        if (slot)
+            from->masks[slot - from->slots] &= ~rec.mask;
+
+        ++delta->records;
+        off = key + deltaPadded(rec.len);
+    }
+    if (off < (size_t)st.st_size)
+        fprintf(stderr, "WARNING: %s: ignoring a torn record at the end\n", path);
+    free(path);
+}
+
+// Replaces the index and its delta log by a hash index of the keys listed
+// in the end, copied into file, with the same kind of perfect hash and Bloom
+// filter as the index had
+void indexFoldDelta(Index *index, FileBuffer *file) {
+    const Slot *slots = index->set.slots;
+    const char *keys = index->set.keys;
+    size_t slot_count = (size_t)1 << index->set.bits;
+    if (index->kind == INDEX_MPH) {
+        slots = index->mph.slots;
+        keys = index->mph.keys;
+        slot_count = index->mph.slot_count;
+    }
+    const Delta *delta = &index->delta;
+
+    size_t capacity = file->size + delta->log.size + 1;
+    char *pool = malloc(capacity);
+    if (!pool) {
+        perror("Error allocating memory");
+        fail();
+    }
+    size_t used = 0;
+    Index folded = { .kind = INDEX_HASH, .file_count = index->file_count, .select = index->select,
+                     .key = index->key };
+    keySetInit(&folded.set, pool, indexKeyCount(index) + delta->added.count);
+    if (folded.file_count > 1)
+        keySetInitMasks(&folded.set);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        // The keys of the index, then those only added by the delta log
+        const Slot *from = pass ? delta->added.slots : slots;
+        const char *from_keys = pass ? delta->added.keys : keys;
+        size_t count = pass ? (size_t)1 << delta->added.bits : slot_count;
+        for (size_t i = 0; i < count && (pass == 0 || delta->log.size); ++i) {
+            if (!from[i].tag)
+                continue;
+            const char *key = from_keys + from[i].off;
+            uint64_t hash = hashKey(key, slotLen(&from[i]));
+            uint32_t mask = 0;
+            if (pass == 0)
+                mask = indexMask(index, &from[i]);
+            else if (indexFind(index, key, slotLen(&from[i]), hash))
+                continue;
+            if (delta->log.size)
+                mask = deltaMask(delta, key, slotLen(&from[i]), hash, mask, false);
+            if (!mask)
+                continue;
+
+            memcpy(pool + used, key, slotLen(&from[i]));
+            if (folded.set.masks)
+                keySetInsertMask(&folded.set, used, slotLen(&from[i]), hash, mask);
+            else
+                keySetAdd(&folded.set, used, slotLen(&from[i]), hash);
+            used += slotLen(&from[i]);
+        }
+    }
+
+    bool mph = index->kind == INDEX_MPH;
+    size_t bloom_bits = index->bloom.block_count * BLOOM_BLOCK_WORDS * 32
+        / (indexKeyCount(index) ? indexKeyCount(index) : 1);
+    freeIndex(index);
+    freeFileBuffer(file);
+    *file = (FileBuffer) { .data = pool, .size = capacity };
+
+    if (mph)
+        indexToMph(&folded);
+    if (bloom_bits)
+        indexAddBloom(&folded, bloom_bits);
+    *index = folded;
+}
+
+// Bump allocator the seen-set copies its keys into. It reserves one large
+// range of address space up front, pages are only backed once written, so
+// offsets stay valid, nothing is ever moved and it is freed in one go.
+typedef struct {
+    char *base;
+    size_t size;
+    size_t reserved;
+} Arena;
+
+#define ARENA_RESERVE ((size_t)1 << (sizeof(size_t) > 4 ? 40 : 30))
+
+void arenaInit(Arena *arena) {
+    // Strict overcommit may refuse a huge reservation, settle for less
+    for (size_t reserve = ARENA_RESERVE; reserve >= BLOCK_SIZE; reserve /= 2) {
+        void *base = mmap(NULL, reserve, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base != MAP_FAILED) {
+            arena->base = base;
+            arena->size = 0;
+            arena->reserved = reserve;
+            return;
+        }
+    }
+    perror("Error allocating memory");
+    fail();
+}
+
+uint64_t arenaPush(Arena *arena, const char *data, size_t len) {
+    if (len > arena->reserved - arena->size) {
+        fprintf(stderr, "Error allocating memory: seen-set exceeds %zu bytes\n", arena->reserved);
+        fail();
+    }
+    uint64_t off = arena->size;
+    memcpy(arena->base + off, data, len);
+    arena->size += len;
+    return off;
+}
+
+void freeArena(Arena *arena) {
+    munmap(arena->base, arena->reserved);
+    arena->base = NULL;
+    arena->size = 0;
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define UNIQUE  1
+#define WHITELIST  2
+
+// Kept output as a list of spans pointing into the input block
+typedef struct {
+    struct iovec *iov;
+    size_t count;
+    size_t capacity;
+} SpanList;
+
+static void spanPush(SpanList *spans, const char *data, size_t len) {
+    if (spans->count) { // Contiguous lines go out as one span
+        struct iovec *last = &spans->iov[spans->count - 1];
+        if ((const char *)last->iov_base + last->iov_len == data) {
+            last->iov_len += len;
+            return;
+        }
+    }
+    if (spans->count == spans->capacity) {
+        spans->capacity = spans->capacity ? spans->capacity * 2 : 256;
+        spans->iov = realloc(spans->iov, spans->capacity * sizeof(struct iovec));
+        if (!spans->iov) {
+            perror("Error allocating memory");
+            fail();
+        }
+    }
+    spans->iov[spans->count++] = (struct iovec) { .iov_base = (void *)data, .iov_len = len };
+}
+
+static void spanFlush(SpanList *spans, int sink) {
+    struct iovec *iov = spans->iov;
+    size_t count = spans->count;
+    while (count) {
+        ssize_t n = writev(sink, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error writing output");
+            fail();
+        }
+        for (; count && (size_t)n >= iov->iov_len; ++iov, --count)
+            n -= iov->iov_len;
+        if (count) { // Partial write
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    spans->count = 0;
+}
+
+// Lines seen so far, for --uniq
+typedef struct {
+    KeySet set;
+    Arena arena;
+} SeenSet;
+
+void seenSetInit(SeenSet *seen) {
+    arenaInit(&seen->arena);
+    keySetInit(&seen->set, seen->arena.base, 0);
+}
+
+// Returns true if the line was not seen before
+static inline bool seenSetInsert(SeenSet *seen, const char *line, size_t len, uint64_t hash) {
+    if (keySetFind(&seen->set, line, len, hash))
+        return false;
+    uint64_t off = arenaPush(&seen->arena, line, len);
+    keySetAdd(&seen->set, off, len, hash);
+    return true;
+}
+
+void freeSeenSet(SeenSet *seen) {
+    freeKeySet(&seen->set);
+    freeArena(&seen->arena);
+}
+
+// Counters of the filter, only reported with --stats
+typedef struct {
+    size_t lines;
+    size_t kept;
+    size_t probes;          // Lookups in the exact index
+    size_t bloom_skipped;   // Lookups the Bloom filter answered
+    size_t bytes;           // Of the lines in
+    size_t uniq;            // Lines in the seen-set of --uniq
+    uint64_t nanos;         // Filtering so far
+    size_t partitions;      // Of --memory-limit, 0 in memory
+} FilterStats;
+
+void addFilterStats(FilterStats *total, const FilterStats *stats) {
+    total->lines += stats->lines;
+    total->kept += stats->kept;
+    total->probes += stats->probes;
+    total->bloom_skipped += stats->bloom_skipped;
+    total->bytes += stats->bytes;
+}
+
+typedef enum {
+    STATS_OFF = 0,
+    STATS_TEXT,
+    STATS_JSON,     // One object per report
+} StatsFormat;
+
+void printStats(FILE *sink, const Index *blacklist, const FilterStats *stats, StatsFormat format);
+
+// --stats-interval: the filter reports its stats so far every interval_ns
+typedef struct {
+    StatsFormat format;
+    uint64_t interval_ns;
+    uint64_t next_ns;
+    struct timespec start;  // Of filtering
+    const Index *blacklist; // NULL with --watch, it may be gone by the report
+} StatsReport;
+
+// Called by the filter after every chunk, only with --stats-interval
+static void statsTick(StatsReport *report, FilterStats *stats) {
+    uint64_t now = elapsedNanos(&report->start);
+    if (now < report->next_ns)
+        return;
+    stats->nanos = now;
+    printStats(stderr, report->blacklist, stats, report->format);
+    report->next_ns = now + report->interval_ns;
+}
+
+// A line that passed the blacklist and still has to pass the seen-set
+typedef struct {
+    size_t off;
+    size_t len;
+    uint64_t hash;
+} PendingLine;
+
+// A run of whole lines from stdin, only the very last line of the input
+// may be missing its newline
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t block;           // Least capacity, BLOCK_SIZE if 0
+
+    SpanList spans;         // Output of the chunk
+    FilterStats stats;
+    PendingLine *pending;   // Lines left for the seen-set, see filterChunk
+    size_t pending_count;
+    size_t pending_capacity;
+} Chunk;
+
+// The start of a line read past the end of the previous chunk
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} Carry;
+
+void freeChunk(Chunk *chunk) {
+    free(chunk->data);
+    free(chunk->spans.iov);
+    free(chunk->pending);
+}
+
+// Fills the chunk with the next whole lines from source, whatever a single
+// read returns, so a slow stream is still filtered line by line.
+// Returns false at the end of the input.
+bool readChunk(int source, Chunk *chunk, Carry *carry) {
+    const size_t block = chunk->block ? chunk->block : BLOCK_SIZE;
+    if (chunk->capacity < block || chunk->capacity < carry->size * 2) {
+        chunk->capacity = carry->size * 2 > block ? carry->size * 2 : block;
+        chunk->data = realloc(chunk->data, chunk->capacity);
+        if (!chunk->data) {
+            perror("Error allocating memory");
+            fail();
+        }
+    }
+    if (carry->size)
+        memcpy(chunk->data, carry->data, carry->size);
+    chunk->size = carry->size;
+    carry->size = 0;
+
+    for (;;) {
+        if (chunk->size == chunk->capacity) { // A line longer than the chunk
+            chunk->data = realloc(chunk->data, chunk->capacity *= 2);
+            if (!chunk->data) {
+                perror("Error allocating memory");
+                fail();
+            }
+        }
+
+        ssize_t n = read(source, chunk->data + chunk->size, chunk->capacity - chunk->size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading input");
+            fail();
+        }
+        if (n == 0)
+            return chunk->size > 0;
+
+        size_t old_size = chunk->size;
+        chunk->size += n;
+
+        // Cut after the last newline, the rest goes to the next chunk
+        size_t end = chunk->size;
+        while (end > old_size && chunk->data[end - 1] != '\n')
+            --end;
+        if (end == old_size)
+            continue;
+
+        size_t rest = chunk->size - end;
+        if (rest > carry->capacity) {
+            carry->capacity = rest > 4096 ? rest : 4096;
+            carry->data = realloc(carry->data, carry->capacity);
+            if (!carry->data) {
+                perror("Error allocating memory");
+                fail();
+            }
+        }
+        if (rest)
+            memcpy(carry->data, chunk->data + end, rest);
+        carry->size = rest;
+        chunk->size = end;
+        return true;
+    }
+}
+
+static void pushLine(Chunk *chunk, const char *line, size_t len) {
+    if (line + len < chunk->data + chunk->size) {
+        spanPush(&chunk->spans, line, len + 1);
+    } else { // The last line is missing its newline
+        spanPush(&chunk->spans, line, len);
+        spanPush(&chunk->spans, "\n", 1);
+    }
+}
+
+#define PROBE_BATCH 32
+
+typedef struct {
+    const char *line;
+    size_t len;
+    const char *key;    // The part of the line looked up, see lineKey
+    size_t key_len;
+    uint64_t hash;      // Of the key
+} Probe;
+
+// What the probes of a filter loop take for constants, so that they are
+// not loaded again after every store to the stats
+typedef struct {
+    bool whole;     // keyFieldWhole
+    bool bloom;
+    bool delta;
+    bool fold;
+} ProbeFlags;
+
+static inline ProbeFlags probeFlags(const Index *blacklist) {
+    return (ProbeFlags) {
+        .whole = keyFieldWhole(&blacklist->key),
+        .bloom = blacklist->bloom.block_count > 0,
+        .delta = blacklist->delta.log.size > 0,
+        .fold = blacklist->key.fold,
+    };
+}
+
+// Narrows the line of a probe down to its key, hashes that if the kind of
+// index looks up hashes and starts loading the memory it will touch first
+static inline __attribute__((always_inline)) void
+probeStart(Probe *p, const Index *blacklist, IndexKind kind, ProbeFlags flags)
+{
+    const bool hashed = kind != INDEX_TRIE && kind != INDEX_PREFIX && kind != INDEX_SMALL;
+    p->key = p->line;
+    p->key_len = p->len;
+    if (!flags.whole)
+        lineKey(&blacklist->key, &p->key, &p->key_len);
+    if (hashed)
+        p->hash = flags.fold ? hashKeyFold(p->key, p->key_len) : hashKey(p->key, p->key_len);
+    if (flags.bloom)
+        bloomPrefetch(&blacklist->bloom, p->hash);
+    else if (kind == INDEX_MPH)
+        __builtin_prefetch(&blacklist->mph.pilots[fastRange(p->hash, blacklist->mph.bucket_count)]);
+    else if (kind == INDEX_INLINE)
+        __builtin_prefetch(inlineSlot(&blacklist->inlined, hashTag(p->hash) >> (32 - blacklist->inlined.bits)));
+    else if (hashed && kind != INDEX_SORTED)
+        __builtin_prefetch(&blacklist->set.slots[slotHome(&blacklist->set, hashTag(p->hash))]);
+}
+
+// Whether the key of a started probe is listed. maybe is what the Bloom
+// filter, if there is one, said about it.
+static inline __attribute__((always_inline)) bool
+probeListed(const Probe *p, const Index *blacklist, IndexKind kind, ProbeFlags flags, bool maybe, FilterStats *stats)
+{
+    const bool bloom = flags.bloom;
+    const bool fold = flags.fold;
+    uint32_t mask = 0;
+    if (kind == INDEX_TRIE) {
+        mask = trieMatch(&blacklist->trie, p->key, p->key_len, fold);
+    } else if (kind == INDEX_PREFIX) {
+        mask = prefixesMatch(&blacklist->prefixes, p->key, p->key_len, fold);
+    } else if (kind == INDEX_SMALL) {
+        ++stats->probes;
+        mask = smallSetMatch(&blacklist->small, p->key, p->key_len, fold);
+    } else if (kind == INDEX_SORTED) {
+        ++stats->probes;
+        mask = sortedSetMatch(&blacklist->sorted, p->key, p->key_len, p->hash, fold);
+    } else if (kind == INDEX_INLINE) {
+        ++stats->probes;
+        mask = inlineSetMatch(&blacklist->inlined, p->key, p->key_len, p->hash, fold);
+    } else if (kind == INDEX_MPH && (!bloom || maybe)) {
+        ++stats->probes;
+        const Slot *entry = mphFind(&blacklist->mph, p->key, p->key_len, p->hash, fold);
+        if (entry)
+            mask = blacklist->mph.masks ? blacklist->mph.masks[entry - blacklist->mph.slots] : 1;
+    } else if (!bloom || maybe) {
+        ++stats->probes;
+        const Slot *entry = keySetLookup(&blacklist->set, p->key, p->key_len, p->hash, fold);
+        if (entry)
+            mask = blacklist->set.masks ? blacklist->set.masks[entry - blacklist->set.slots] : 1;
+    } else {
+        ++stats->bloom_skipped;
+    }
+    if (flags.delta)
+        mask = deltaMask(&blacklist->delta, p->key, p->key_len, p->hash, mask, fold);
+    return selectionMatch(&blacklist->select, mask);
+}
+
+// Runs the lines of the chunk through the blacklist and collects the kept
+// ones as spans. With --uniq and no seen-set the lines that pass are left
+// pending, so that they can be checked against the seen-set in input order.
+//
+// Lines are probed in batches: all of a batch are hashed and their Bloom
+// blocks and slots prefetched before the first one is looked up, so the
+// cache misses of a batch overlap instead of queuing up one line at a time.
+//
+// kind, whitelist and uniq are constants in every copy filterChunk makes
+// of this, so the loop does not test them line by line.
+static inline __attribute__((always_inline)) void
+filterLines(Chunk *chunk, const Index *blacklist, SeenSet *seen, IndexKind kind, bool whitelist, bool uniq)
+{
+    LineScanner sc;
+    lineScannerInit(&sc, chunk->data, chunk->size, false);
+
+    chunk->spans.count = 0;
+    chunk->pending_count = 0;
+    chunk->stats = (FilterStats) { .bytes = chunk->size };
+
+    const ProbeFlags flags = probeFlags(blacklist);
+    const bool bloom = flags.bloom;
+    const bool hashed = kind != INDEX_TRIE && kind != INDEX_PREFIX && kind != INDEX_SMALL;
+    Probe batch[PROBE_BATCH];
+    bool maybe[PROBE_BATCH];
+
+    size_t start = 0;
+    while (start < chunk->size) {
+        size_t n = 0;
+        for (; n < PROBE_BATCH && start < chunk->size; ++n) {
+            size_t sep = nextLineSep(&sc);
+            batch[n].line = chunk->data + start;
+            batch[n].len = sep - start;
+            probeStart(&batch[n], blacklist, kind, flags);
+            start = sep + 1;
+        }
+        chunk->stats.lines += n;
+
+        for (size_t i = 0; bloom && i < n; ++i) {
+            maybe[i] = bloomMayContain(&blacklist->bloom, batch[i].hash);
+            if (maybe[i])
+                indexPrefetch(blacklist, batch[i].hash);
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            const Probe *p = &batch[i];
+            bool listed = probeListed(p, blacklist, kind, flags, bloom && maybe[i], &chunk->stats);
+            if (listed != whitelist) // Skip line if in blacklist
+                continue;
+
+            if (uniq) {
+                // Lines are unique as a whole, not by key
+                uint64_t hash = hashed && flags.whole && !flags.fold ? p->hash : hashKey(p->line, p->len);
+                if (!seen) {
+                    if (chunk->pending_count == chunk->pending_capacity) {
+                        chunk->pending_capacity = chunk->pending_capacity ? chunk->pending_capacity * 2 : 1024;
+                        chunk->pending = realloc(chunk->pending, chunk->pending_capacity * sizeof(PendingLine));
+                        if (!chunk->pending) {
+                            perror("Error allocating memory");
+                            fail();
+                        }
+                    }
+                    chunk->pending[chunk->pending_count++] = (PendingLine) {
+                        .off = p->line - chunk->data, .len = p->len, .hash = hash,
+                    };
+                    continue;
+                }
+                if (!seenSetInsert(seen, p->line, p->len, hash)) // Line already printed
+                    continue;
+            }
+
+            pushLine(chunk, p->line, p->len);
+            ++chunk->stats.kept;
+        }
+    }
+}
+
+#define FILTER_LINES(kind)                                                          \
+    (whitelist ? (uniq ? filterLines(chunk, blacklist, seen, kind, true, true)      \
+                       : filterLines(chunk, blacklist, seen, kind, true, false))    \
+               : (uniq ? filterLines(chunk, blacklist, seen, kind, false, true)     \
+                       : filterLines(chunk, blacklist, seen, kind, false, false)))
+
+void filterChunk(Chunk *chunk, const Index *blacklist, uint32_t flags, SeenSet *seen) {
+    const bool whitelist = flags & WHITELIST;
+    const bool uniq = flags & UNIQUE;
+    switch (blacklist->kind) {
+    case INDEX_MPH:
+        FILTER_LINES(INDEX_MPH);
+        break;
+    case INDEX_TRIE:
+        FILTER_LINES(INDEX_TRIE);
+        break;
+    case INDEX_PREFIX:
+        FILTER_LINES(INDEX_PREFIX);
+        break;
+    case INDEX_SMALL:
+        FILTER_LINES(INDEX_SMALL);
+        break;
+    case INDEX_SORTED:
+        FILTER_LINES(INDEX_SORTED);
+        break;
+    case INDEX_INLINE:
+        FILTER_LINES(INDEX_INLINE);
+        break;
+    default:
+        FILTER_LINES(INDEX_HASH);
+        break;
+    }
+}
+
+// Second half of filterChunk for pending lines, the first occurrence wins
+void uniqChunk(Chunk *chunk, SeenSet *seen) {
+    for (size_t i = 0; i < chunk->pending_count; ++i) {
+        const PendingLine *p = &chunk->pending[i];
+        const char *line = chunk->data + p->off;
+        if (seenSetInsert(seen, line, p->len, p->hash)) {
+            pushLine(chunk, line, p->len);
+            ++chunk->stats.kept;
+        }
+    }
+}
+
+// filterLines for lines that are not in a chunk, see blacklist_filter. Sets
+// the bits of the kept ones in keep and returns how many there are.
+static inline __attribute__((always_inline)) size_t
+filterBatchLines(const Index *blacklist, const blacklist_line *lines, size_t count, uint64_t *keep, IndexKind kind,
+                 bool whitelist)
+{
+    const ProbeFlags flags = probeFlags(blacklist);
+    const bool bloom = flags.bloom;
+    Probe batch[PROBE_BATCH];
+    bool maybe[PROBE_BATCH];
+    FilterStats stats = { 0 };
+    size_t kept = 0;
+
+    for (size_t first = 0; first < count; first += PROBE_BATCH) {
+        size_t n = count - first < PROBE_BATCH ? count - first : PROBE_BATCH;
+        for (size_t i = 0; i < n; ++i) {
+            batch[i].line = lines[first + i].data;
+            batch[i].len = lines[first + i].len;
+            probeStart(&batch[i], blacklist, kind, flags);
+        }
+        for (size_t i = 0; bloom && i < n; ++i) {
+            maybe[i] = bloomMayContain(&blacklist->bloom, batch[i].hash);
+            if (maybe[i])
+                indexPrefetch(blacklist, batch[i].hash);
+        }
+        // A batch never straddles two words of the bitmap
+        _Static_assert(64 % PROBE_BATCH == 0, "PROBE_BATCH has to divide 64");
+        uint64_t bits = 0;
+        for (size_t i = 0; i < n; ++i)
+            bits |= (uint64_t)(probeListed(&batch[i], blacklist, kind, flags, bloom && maybe[i], &stats) == whitelist) << i;
+        kept += __builtin_popcountll(bits);
+        const unsigned shift = first % 64;
+        const uint64_t mask = (n == 64 ? ~0ULL : (1ULL << n) - 1) << shift;
+        keep[first / 64] = (keep[first / 64] & ~mask) | bits << shift;
+    }
+    return kept;
+}
+
+size_t filterBatch(const Index *blacklist, const blacklist_line *lines, size_t count, uint64_t *keep, bool whitelist) {
+    switch (blacklist->kind) {
+    case INDEX_MPH:
+        return filterBatchLines(blacklist, lines, count, keep, INDEX_MPH, whitelist);
+    case INDEX_TRIE:
+        return filterBatchLines(blacklist, lines, count, keep, INDEX_TRIE, whitelist);
+    case INDEX_PREFIX:
+        return filterBatchLines(blacklist, lines, count, keep, INDEX_PREFIX, whitelist);
+    case INDEX_SMALL:
+        return filterBatchLines(blacklist, lines, count, keep, INDEX_SMALL, whitelist);
+    case INDEX_SORTED:
+        return filterBatchLines(blacklist, lines, count, keep, INDEX_SORTED, whitelist);
+    case INDEX_INLINE:
+        return filterBatchLines(blacklist, lines, count, keep, INDEX_INLINE, whitelist);
+    default:
+        return filterBatchLines(blacklist, lines, count, keep, INDEX_HASH, whitelist);
+    }
+}
+
+// How loadIndex builds the index of plain blacklist files
+typedef struct {
+    bool mph;
+    uint64_t bloom;         // Bits per key, 0 for none
+    bool verify;            // Of a compiled one
+    MatchMode match;
+    KeyField key;           // Of the lines of the files
+    bool adapt;             // Pick the kind of an exact match index by its keys, see indexChoose
+    IndexKind kind;         // Else INDEX_HASH, INDEX_SMALL or INDEX_SORTED
+    size_t threads;         // Hashing the files, see hashFilesParallel
+} IndexOptions;
+
+// A blacklist as loaded by loadIndex, --watch swaps in a new one as a whole
+typedef struct {
+    Index index;
+    FileBuffer file;
+} Blacklist;
+
+void freeBlacklist(Blacklist *blacklist) {
+    freeIndex(&blacklist->index);
+    freeFileBuffer(&blacklist->file);
+    free(blacklist);
+}
+
+// A thread filtering with the current blacklist of a Watch
+typedef struct {
+    _Alignas(64) _Atomic uint64_t epoch;    // Epoch it went online in, 0 while offline
+    bool during_reload;     // A reload was running when it went online
+    struct timespec online;
+    size_t lines[2];        // Lines filtered, [1] while a reload was running
+    uint64_t nanos[2];
+} RcuReader;
+
+// --watch: the blacklist is rebuilt in the background when one of its files
+// changes and swapped in read-copy-update style, so filtering never blocks
+// on it. A reader goes online to take the current blacklist for a chunk and
+// offline once done, and stays offline while it reads or waits. The old
+// blacklist is freed once every reader has been offline since the swap.
+typedef struct {
+    Blacklist *_Atomic current;
+    _Atomic uint64_t epoch;
+    _Atomic bool reloading;
+    RcuReader *readers;
+    size_t reader_count;
+
+    char **filenames;
+    size_t count;
+    IndexOptions options;
+    StatsFormat stats;
+    int inotify;
+    int *watches;           // Watch descriptor of the directory of each file
+    int stop[2];            // Pipe closed to stop the watch thread
+    pthread_t thread;
+
+    size_t reloads;
+    double last_ms;         // From the change to the swap
+    double max_ms;
+    double grace_ms;        // Waiting for the readers, all reloads
+} Watch;
+
+// Takes the current blacklist, it stays valid until rcuOffline
+static const Index *rcuOnline(Watch *watch, RcuReader *reader) {
+    atomic_store(&reader->epoch, atomic_load(&watch->epoch));
+    reader->during_reload = atomic_load(&watch->reloading);
+    clock_gettime(CLOCK_MONOTONIC, &reader->online);
+    return &atomic_load(&watch->current)->index;
+}
+
+static void rcuOffline(RcuReader *reader, size_t lines) {
+    atomic_store(&reader->epoch, 0);
+    reader->lines[reader->during_reload] += lines;
+    reader->nanos[reader->during_reload] += elapsedNanos(&reader->online);
+}
+
+typedef enum {
+    CHUNK_FREE = 0,
+    CHUNK_READ,
+    CHUNK_FILTERED,
+} ChunkState;
+
+// Reader -> workers -> writer, the chunks form a ring indexed by sequence
+// number, so the writer can put them back in input order
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    Chunk *chunks;
+    ChunkState *states;
+    size_t chunk_count;
+    size_t read_seq;    // Chunks read so far
+    size_t work_seq;    // Chunks taken by a worker so far
+    bool eof;
+
+    int source;
+    const Index *blacklist;
+    Watch *watch;           // NULL unless --watch
+    size_t workers;         // Workers started so far, the reader of each
+    uint32_t flags;
+} Pipeline;
+
+static void *pipelineReader(void *arg) {
+    Pipeline *p = arg;
+    Carry carry = { 0 };
+
+    for (size_t seq = 0;; ++seq) {
+        size_t i = seq % p->chunk_count;
+
+        pthread_mutex_lock(&p->lock);
+        while (p->states[i] != CHUNK_FREE)
+            pthread_cond_wait(&p->changed, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+
+        bool more = readChunk(p->source, &p->chunks[i], &carry);
+
+        pthread_mutex_lock(&p->lock);
+        if (more) {
+            p->states[i] = CHUNK_READ;
+            p->read_seq = seq + 1;
+        } else {
+            p->eof = true;
+        }
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+        if (!more)
+            break;
+    }
+
+    free(carry.data);
+    return NULL;
+}
+
+static void *pipelineWorker(void *arg) {
+    Pipeline *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    RcuReader *reader = p->watch ? &p->watch->readers[p->workers] : NULL;
+    ++p->workers;
+    pthread_mutex_unlock(&p->lock);
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->work_seq == p->read_seq && !p->eof)
+            pthread_cond_wait(&p->changed, &p->lock);
+        if (p->work_seq == p->read_seq) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        size_t i = p->work_seq++ % p->chunk_count;
+        pthread_mutex_unlock(&p->lock);
+
+        if (reader) {
+            filterChunk(&p->chunks[i], rcuOnline(p->watch, reader), p->flags, NULL);
+            rcuOffline(reader, p->chunks[i].stats.lines);
+        } else {
+            filterChunk(&p->chunks[i], p->blacklist, p->flags, NULL);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->states[i] = CHUNK_FILTERED;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+// Filters with a reader thread, `jobs` workers and the calling thread
+// writing the chunks in input order. With a watch, blacklist is unused and
+// the watch needs a reader per job.
+void parseParallel(int sink, int source, const Index *blacklist, Watch *watch, uint32_t flags,
+                   size_t jobs, StatsReport *report, FilterStats *stats)
+{
+    Pipeline p = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .changed = PTHREAD_COND_INITIALIZER,
+        .chunk_count = 2 * jobs + 2,
+        .source = source,
+        .blacklist = blacklist,
+        .watch = watch,
+        .flags = flags,
+    };
+    p.chunks = calloc(p.chunk_count, sizeof(Chunk));
+    p.states = calloc(p.chunk_count, sizeof(ChunkState));
+    pthread_t *threads = calloc(jobs + 1, sizeof(pthread_t));
+    if (!p.chunks || !p.states || !threads) {
+        perror("Error allocating memory");
+        fail();
+    }
+
+    SeenSet seen;
+    if (flags & UNIQUE)
+        seenSetInit(&seen);
+
+    pthread_create(&threads[0], NULL, pipelineReader, &p);
+    for (size_t j = 1; j <= jobs; ++j)
+        pthread_create(&threads[j], NULL, pipelineWorker, &p);
+
+    for (size_t seq = 0;; ++seq) {
+        size_t i = seq % p.chunk_count;
+
+        pthread_mutex_lock(&p.lock);
+        while (p.states[i] != CHUNK_FILTERED && !(p.eof && seq == p.read_seq))
+            pthread_cond_wait(&p.changed, &p.lock);
+        bool done = p.states[i] != CHUNK_FILTERED;
+        pthread_mutex_unlock(&p.lock);
+        if (done)
+            break;
+
+        if (flags & UNIQUE)
+            uniqChunk(&p.chunks[i], &seen);
+        spanFlush(&p.chunks[i].spans, sink);
+        addFilterStats(stats, &p.chunks[i].stats);
+        if (flags & UNIQUE)
+            stats->uniq = seen.set.count;
+        if (report)
+            statsTick(report, stats);
+
+        pthread_mutex_lock(&p.lock);
+        p.states[i] = CHUNK_FREE;
+        pthread_cond_broadcast(&p.changed);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    for (size_t j = 0; j <= jobs; ++j)
+        pthread_join(threads[j], NULL);
+
+    if (flags & UNIQUE)
+        freeSeenSet(&seen);
+    for (size_t i = 0; i < p.chunk_count; ++i)
+        freeChunk(&p.chunks[i]);
+    free(p.chunks);
+    free(p.states);
+    free(threads);
+}
+
+// With a watch, blacklist is unused and the watch needs a reader. report is
+// NULL unless --stats-interval.
+void 
+parse(int sink, int source, const Index *blacklist, Watch *watch, uint32_t flags, StatsReport *report,
+      FilterStats *stats)
+{
+    SeenSet seen;
+    if (flags & UNIQUE)
+        seenSetInit(&seen);
+
+    Chunk chunk = { 0 };
+    Carry carry = { 0 };
+    while (readChunk(source, &chunk, &carry)) {
+        if (watch) {
+            filterChunk(&chunk, rcuOnline(watch, &watch->readers[0]), flags, (flags & UNIQUE) ? &seen : NULL);
+            rcuOffline(&watch->readers[0], chunk.stats.lines);
+        } else {
+            filterChunk(&chunk, blacklist, flags, (flags & UNIQUE) ? &seen : NULL);
+        }
+        spanFlush(&chunk.spans, sink);
+        addFilterStats(stats, &chunk.stats);
+        if (flags & UNIQUE)
+            stats->uniq = seen.set.count;
+        if (report)
+            statsTick(report, stats);
+    }
+
+    freeChunk(&chunk);
+    free(carry.data);
+    if (flags & UNIQUE)
+        freeSeenSet(&seen);
+}
+
+// Byte-wise order of lines, the order of `LC_ALL=C sort`
+static int compareLines(const char *a, size_t alen, const char *b, size_t blen) {
+    size_t n = alen < blen ? alen : blen;
+    int c = n ? memcmp(a, b, n) : 0;    // An empty line may have no buffer
+    if (c)
+        return c;
+    return (alen > blen) - (alen < blen);
+}
+
+// Reads the lines of a sorted file one at a time, in memory bounded by the
+// longest line, and fails if a line is smaller than the one before it
+typedef struct {
+    const char *name;
+    int fd;
+    char *buff;
+    size_t size;
+    size_t capacity;
+    size_t pos;         // Start of the next line
+    bool eof;
+    bool skip_empty;
+    LineScanner sc;
+
+    char *prev;         // Copy of the previous line to check the order
+    size_t prev_len;
+    size_t prev_capacity;
+    bool has_prev;
+    size_t line_no;
+    bool dup;           // The last line equals the one before it
+} LineReader;
+
+void lineReaderInit(LineReader *r, const char *name, int fd, bool blacklist, size_t block) {
+    *r = (LineReader) { .name = name, .fd = fd, .skip_empty = blacklist, .capacity = block };
+    r->buff = malloc(r->capacity);
+    if (!r->buff) {
+        perror("Error allocating memory");
+        fail();
+    }
+    r->sc = (LineScanner) { .buff = r->buff, .nul_sep = blacklist }; // Empty until the first read
+}
+
+void freeLineReader(LineReader *r) {
+    free(r->buff);
+    free(r->prev);
+}
+
+// Returns false at the end of the file, the line stays valid until the next
+// call. The order of the lines is not checked.
+bool lineReaderNextUnordered(LineReader *r, const char **line, size_t *len) {
+    for (;;) {
+        size_t sep = nextLineSep(&r->sc);
+        if (sep == r->size && !r->eof) {
+            // Move the unfinished line to the front and read more
+            r->size -= r->pos;
+            memmove(r->buff, r->buff + r->pos, r->size);
+            r->pos = 0;
+            if (r->size == r->capacity) {
+                r->buff = realloc(r->buff, r->capacity *= 2);
+                if (!r->buff) {
+                    perror("Error allocating memory");
+                    fail();
+                }
+            }
+            ssize_t n;
+            while ((n = read(r->fd, r->buff + r->size, r->capacity - r->size)) < 0) {
+                if (errno != EINTR) {
+                    fprintf(stderr, "Error reading %s: %s\n", r->name, strerror(errno));
+                    fail();
+                }
+            }
+            r->eof = n == 0;
+            r->size += n;
+            lineScannerInit(&r->sc, r->buff, r->size, r->sc.nul_sep);
+            continue;
+        }
+        if (r->pos >= r->size)
+            return false;
+
+        *line = r->buff + r->pos;
+        *len = sep - r->pos;
+        r->pos = sep + 1;
+        ++r->line_no;
+        if (*len == 0 && r->skip_empty)
+            continue;
+        return true;
+    }
+}
+
+// Same as lineReaderNextUnordered, but fails if the line is smaller than the
+// one before it
+bool lineReaderNext(LineReader *r, const char **line, size_t *len) {
+    if (!lineReaderNextUnordered(r, line, len))
+        return false;
+
+    int order = r->has_prev ? compareLines(*line, *len, r->prev, r->prev_len) : 1;
+    if (order < 0) {
+        fprintf(stderr, "ERROR: %s:%zu: not sorted, the line is smaller than the one before it"
+                " (sort with LC_ALL=C)\n", r->name, r->line_no);
+        fail();
+    }
+    r->dup = order == 0;
+    if (*len > r->prev_capacity) {
+        r->prev_capacity = *len * 2;
+        r->prev = realloc(r->prev, r->prev_capacity);
+        if (!r->prev) {
+            perror("Error allocating memory");
+            fail();
+        }
+    }
+    if (*len)
+        memcpy(r->prev, *line, *len);
+    r->prev_len = *len;
+    r->has_prev = true;
+    return true;
+}
+
+// Filters sorted stdin against sorted blacklist files by merging them, like
+// comm(1), so memory does not depend on the size of the blacklist
+void parseSorted(FILE *sink, int source, char **filenames, size_t count, const Selection *select,
+                 uint32_t flags, FilterStats *stats)
+{
+    LineReader input;
+    lineReaderInit(&input, "<stdin>", source, false, BLOCK_SIZE);
+
+    LineReader files[MAX_FILES];
+    const char *heads[MAX_FILES];
+    size_t head_lens[MAX_FILES];
+    bool has_head[MAX_FILES];
+    for (size_t i = 0; i < count; ++i) {
+        int fd = open(filenames[i], O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Error opening file %s: %s\n", filenames[i], strerror(errno));
+            fail();
+        }
+        lineReaderInit(&files[i], filenames[i], fd, true, BLOCK_SIZE);
+        has_head[i] = lineReaderNext(&files[i], &heads[i], &head_lens[i]);
+    }
+
+    const char *line;
+    size_t line_len;
+    while (lineReaderNext(&input, &line, &line_len)) {
+        ++stats->lines;
+        stats->bytes += line_len + 1;
+        if ((flags & UNIQUE) && input.dup) // Line already printed, or dropped like this one
+            continue;
+
+        uint32_t mask = 0;
+        for (size_t i = 0; i < count; ++i) {
+            int order = -1;
+            while (has_head[i] && (order = compareLines(heads[i], head_lens[i], line, line_len)) < 0)
+                has_head[i] = lineReaderNext(&files[i], &heads[i], &head_lens[i]);
+            if (has_head[i] && order == 0)
+                mask |= 1U << i;
+        }
+
+        bool listed = selectionMatch(select, mask);
+        if (( !(flags & WHITELIST) && listed) ||
+            ( (flags & WHITELIST) && !listed) ) // Skip line if in blacklist
+            continue;
+
+        fwrite(line, 1, line_len, sink);
+        fputc('\n', sink);
+        ++stats->kept;
+    }
+    fflush(sink);
+
+    freeLineReader(&input);
+    for (size_t i = 0; i < count; ++i) {
+        close(files[i].fd);
+        freeLineReader(&files[i]);
+    }
+}
+
+// Appends the lines of source to the delta log of a compiled index in one
+// write, a reader sees all of them or, if it is cut short, a torn record.
+// Only the part of a line given by kf is a key, in lower case if the index
+// is.
+void appendDelta(const char *filename, uint32_t op, uint32_t mask, const KeyField *kf, int source) {
+    BlxHeader base;
+    readIndexHeader(filename, &base);
+    const bool fold = base.flags & BLX_FOLD_CASE;
+
+    char *buff = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    LineReader r;
+    lineReaderInit(&r, "<stdin>", source, true, BLOCK_SIZE);
+    const char *line;
+    size_t len;
+    while (lineReaderNextUnordered(&r, &line, &len)) {
+        lineKey(kf, &line, &len);
+        if (len == 0)
+            continue;
+        size_t need = sizeof(DeltaRecord) + deltaPadded(len);
+        if (size + need > capacity) {
+            capacity = (size + need) * 2;
+            buff = realloc(buff, capacity);
+            if (!buff) {
+                perror("Error allocating memory");
+                fail();
+            }
+        }
+        char *key = buff + size + sizeof(DeltaRecord);
+        memcpy(key, line, len);
+        if (fold)
+            foldInPlace(key, len);
+        DeltaRecord rec = { .op = op, .mask = mask, .len = len };
+        rec.checksum = deltaChecksum(&rec, key);
+        memcpy(buff + size, &rec, sizeof(rec));
+        memset(buff + size + sizeof(rec) + len, 0, need - sizeof(rec) - len);
+        size += need;
+    }
+    freeLineReader(&r);
+
+    // A log that does not exist yet or was left over from a compaction is
+    // replaced by one with just the header, so it never lacks one
+    char *path = deltaPath(filename);
+    DeltaHeader header = { .version = DELTA_VERSION, .byte_order = BLX_BYTE_ORDER,
+                           .base_checksum = base.data_checksum };
+    memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+    DeltaHeader existing;
+    int fd = open(path, O_RDONLY);
+    bool fresh = fd < 0 || pread(fd, &existing, sizeof(existing), 0) != sizeof(existing)
+        || memcmp(&existing, &header, sizeof(header)) != 0;
+    if (fd >= 0)
+        close(fd);
+    if (fresh) {
+        size_t tmplen = strlen(path) + 32;
+        char *tmpname = malloc(tmplen);
+        snprintf(tmpname, tmplen, "%s.tmp%ld", path, (long)getpid());
+        fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write(fd, &header, sizeof(header)) != sizeof(header) || close(fd) != 0
+            || rename(tmpname, path) != 0) {
+            perror("Error writing delta log");
+            unlink(tmpname);
+            fail();
+        }
+        free(tmpname);
+    }
+
+    fd = open(path, O_WRONLY | O_APPEND);
+    if (fd < 0) {
+        perror("Error opening delta log");
+        fail();
+    }
+    for (size_t done = 0; done < size;) {
+        ssize_t n = write(fd, buff + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("Error writing delta log");
+            fail();
+        }
+        done += n;
+    }
+    if (fdatasync(fd) != 0 || close(fd) != 0) {
+        perror("Error writing delta log");
+        fail();
+    }
+    free(path);
+    free(buff);
+}
+
+// Header of a line in a spill file, the line itself follows
+typedef struct {
+    uint64_t id;    // Input line number, or the blacklist file a key is from
+    uint64_t len;
+} SpillRecord;
+
+#define SPILL_MIN_BUFFER (1 << 12)
+#define SPILL_MAX_BUFFER (1 << 16)
+#define MAX_PARTITIONS 4096
+#define GRACE_SAMPLE (1 << 16)          // Read of a blacklist-file to guess its lines
+#define GRACE_MIN_MEMORY (1 << 18)      // Below this the limit is not kept
+
+// A temporary file and its stdio buffer
+typedef struct {
+    FILE *f;
+    char *buff;
+} Spill;
+
+// Opens an anonymous temporary file, it is gone once closed
+void spillOpen(Spill *s, size_t buffer) {
+    const char *dir = getenv("TMPDIR");
+    size_t len = strlen(dir ? dir : "/tmp") + 32;
+    char *path = malloc(len);
+    s->buff = malloc(buffer);
+    if (!path || !s->buff) {
+        perror("Error allocating memory");
+        fail();
+    }
+    snprintf(path, len, "%s/blacklist.XXXXXX", dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating a temporary file in %s: %s\n", dir ? dir : "/tmp", strerror(errno));
+        fail();
+    }
+    unlink(path);
+    free(path);
+
+    s->f = fdopen(fd, "w+b");
+    if (!s->f) {
+        perror("Error creating a temporary file");
+        fail();
+    }
+    // The buffer is given, glibc ignores the size of one it allocates
+    setvbuf(s->f, s->buff, _IOFBF, buffer);
+}
+
+void spillClose(Spill *s) {
+    fclose(s->f);
+    free(s->buff);
+}
+
+static void spillWrite(FILE *f, uint64_t id, const char *line, size_t len) {
+    SpillRecord rec = { .id = id, .len = len };
+    if (fwrite(&rec, sizeof(rec), 1, f) != 1 || (len && fwrite(line, 1, len, f) != len)) {
+        perror("Error writing a temporary file");
+        fail();
+    }
+}
+
+// Offset of the next record written
+static uint64_t spillTell(Spill *s) {
+    off_t off = ftello(s->f);
+    if (off < 0) {
+        perror("Error writing a temporary file");
+        fail();
+    }
+    return off;
+}
+
+// Writes out the buffer, returns the size of the file
+static uint64_t spillEnd(Spill *s) {
+    if (fflush(s->f) != 0) {
+        perror("Error writing a temporary file");
+        fail();
+    }
+    return spillTell(s);
 }
 
-// Function to read the contents of a file into memory
-char* readFile(const char *filename, size_t *size) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
+// Reads the next record into *line, growing it as needed
+static bool spillRead(FILE *f, SpillRecord *rec, char **line, size_t *capacity) {
+    if (fread(rec, sizeof(*rec), 1, f) != 1)
+        return false;
+    if (rec->len > *capacity || !*line) { // Even an empty line gets a buffer
+        *capacity = rec->len * 2 + 16;
+        *line = realloc(*line, *capacity);
+        if (!*line) {
+            perror("Error allocating memory");
+            fail();
+        }
     }
+    if (fread(*line, 1, rec->len, f) != rec->len) {
+        perror("Error reading a temporary file");
+        fail();
+    }
+    return true;
+}
+
+// Partition of a hash, from its low bits as the key set takes the high ones
+static inline size_t spillPartition(uint64_t hash, size_t partitions) {
+    return ((hash & 0xffffffffULL) * partitions) >> 32;
+}
 
-    // Determine the file size
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-    rewind(file);
+// How parseGrace splits the work to stay within --memory-limit
+typedef struct {
+    size_t partitions;  // Of the blacklist, by hash
+    size_t fanout;      // Spill files written or runs merged at once
+    size_t buffer;      // Of every spill file and run
+    size_t block;       // Read of a blacklist-file or stdin
+} GracePlan;
+
+// Memory of an index of keys keys taking bytes bytes: the mapped spill file
+// of the keys and up to 2.5 slots a key, with masks to tell files apart
+static size_t graceIndexBytes(size_t keys, size_t bytes, bool masks) {
+    size_t slot = sizeof(Slot) + (masks ? sizeof(uint32_t) : 0);
+    return bytes + keys * sizeof(SpillRecord) + keys * slot * 5 / 2;
+}
 
-    // Allocate memory to store the file content
-    char *buffer = (char *)malloc(fileSize + 1);
-    if (!buffer) {
+// Plans parseGrace to keep the process within limit bytes, returns false
+// if the index of the blacklist-files fits as a whole
+bool gracePlan(char **filenames, size_t count, size_t limit, GracePlan *plan) {
+    char *sample = malloc(GRACE_SAMPLE);
+    if (!sample) {
         perror("Error allocating memory");
-        fclose(file);
-        exit(EXIT_FAILURE);
+        fail();
     }
-
-    // Read the file into the buffer
-    *size = fread(buffer, 1, fileSize, file);
-    if (*size != fileSize) {
-        perror("Error reading file");
-        free(buffer);
-        fclose(file);
-        exit(EXIT_FAILURE);
+    size_t bytes = 0, keys = 0;
+    for (size_t i = 0; i < count; ++i) {
+        struct stat st;
+        int fd = open(filenames[i], O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "Error opening file %s: %s\n", filenames[i], strerror(errno));
+            fail();
+        }
+        if (!S_ISREG(st.st_mode)) {
+            fprintf(stderr, "Error sizing %s for --memory-limit: not a regular file\n", filenames[i]);
+            fail();
+        }
+        ssize_t n;
+        while ((n = pread(fd, sample, GRACE_SAMPLE, 0)) < 0 && errno == EINTR)
+            ;
+        if (n < 0) {
+            fprintf(stderr, "Error reading %s: %s\n", filenames[i], strerror(errno));
+            fail();
+        }
+        close(fd);
+        bytes += st.st_size;
+        if (n > 0)
+            keys += (double)estimateLines(sample, n) * st.st_size / n;
     }
+    free(sample);
+
+    // What the process takes already, the program, its libraries and stdio
+    struct rusage usage;
+    size_t base = getrusage(RUSAGE_SELF, &usage) == 0 ? (size_t)usage.ru_maxrss * 1024 : 0;
+    size_t index = graceIndexBytes(keys, bytes, count > 1);
+    if (base + index + 2 * BLOCK_SIZE <= limit)
+        return false;
 
-    // Null-terminate the buffer
-    buffer[fileSize] = '\0';
+    size_t memory = limit > base ? limit - base : 0;
+    if (memory < GRACE_MIN_MEMORY) {
+        fprintf(stderr, "WARNING: --memory-limit is below what the program needs, it takes about %zu KiB\n",
+                (base + GRACE_MIN_MEMORY) >> 10);
+        memory = GRACE_MIN_MEMORY;
+    }
+    // Half of it for the index of a partition, the other half for the reads
+    // of the blacklist-files and stdin and the spill buffers
+    plan->block = memory / 16 > BLOCK_SIZE ? BLOCK_SIZE : memory / 16;
+    size_t buffers = memory / 2 - 2 * plan->block;
 
-    // Close the file
-    fclose(file);
+    // A pass has the keys and the lines of its partitions open, besides
+    // stdio, a blacklist-file, the kept lines and the spilled stdin
+    struct rlimit nofile;
+    size_t files = getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY
+        ? nofile.rlim_cur : SIZE_MAX;
+    size_t fanout = files > 20 ? (files - 16) / 2 : 2;
+    if (fanout > buffers / (2 * SPILL_MIN_BUFFER))
+        fanout = buffers / (2 * SPILL_MIN_BUFFER);
+    if (fanout > MAX_PARTITIONS)
+        fanout = MAX_PARTITIONS;
+    plan->fanout = fanout > 2 ? fanout : 2;
+    plan->buffer = buffers / (2 * plan->fanout);
+    if (plan->buffer < SPILL_MIN_BUFFER)
+        plan->buffer = SPILL_MIN_BUFFER;
+    if (plan->buffer > SPILL_MAX_BUFFER)
+        plan->buffer = SPILL_MAX_BUFFER;
 
-    return buffer;
+    size_t budget = memory / 2;
+    plan->partitions = (index + budget - 1) / budget;
+    if (plan->partitions < 2)
+        plan->partitions = 2;
+    return true;
 }
 
-// Define a for storing key-value pairs
+// A run of records in a spill file, read through a buffer of its own so
+// that many runs of the file are read at once
 typedef struct {
-    char *key;
-    UT_hash_handle hh;
-} KeyHash;
+    int fd;
+    uint64_t off;       // Of the rest of the run
+    uint64_t end;
+    char *buff;
+    size_t size;
+    size_t pos;
+    size_t capacity;
 
-typedef struct {
-    KeyHash *hashTable;
-    KeyHash *entries;
-} FileHash;
+    SpillRecord rec;
+    char *line;
+    size_t line_capacity;
+} RunReader;
 
-_Bool isLineSep(char ch) {
-    return ch == '\n' || ch == '\0';
+static void runRead(RunReader *r, void *dst, size_t n) {
+    while (n > 0) {
+        if (r->pos == r->size) {
+            size_t want = r->end - r->off < r->capacity ? r->end - r->off : r->capacity;
+            ssize_t got = want ? pread(r->fd, r->buff, want, r->off) : 0;
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0) {
+                fprintf(stderr, "Error reading a temporary file: %s\n", got < 0 ? strerror(errno) : "truncated");
+                fail();
+            }
+            r->off += got;
+            r->size = got;
+            r->pos = 0;
+        }
+        size_t take = r->size - r->pos < n ? r->size - r->pos : n;
+        memcpy(dst, r->buff + r->pos, take);
+        dst = (char *)dst + take;
+        r->pos += take;
+        n -= take;
+    }
+}
+
+// Reads the next record of the run, false at its end
+static bool runNext(RunReader *r) {
+    if (r->pos == r->size && r->off == r->end)
+        return false;
+    runRead(r, &r->rec, sizeof(r->rec));
+    if (r->rec.len > r->line_capacity) {
+        r->line_capacity = r->rec.len * 2;
+        r->line = realloc(r->line, r->line_capacity);
+        if (!r->line) {
+            perror("Error allocating memory");
+            fail();
+        }
+    }
+    runRead(r, r->line, r->rec.len);
+    return true;
 }
 
-// Function to read all lines from a file and insert into the hash table
-void hashFile(char *filebuff, size_t buffsize, FileHash *fileHash) {
-    size_t line_count = 0;
+// Merges the runs from bounds[i] to bounds[i + 1] of fd, every one in line
+// number order, into one: as records into out, or as lines into sink. The
+// next line is always the smallest line number at the front of some run.
+static void mergeRuns(int fd, const uint64_t *bounds, size_t count, size_t buffer, Spill *out, FILE *sink,
+                      FilterStats *stats)
+{
+    RunReader *runs = calloc(count, sizeof(RunReader));
+    size_t *heap = malloc(count * sizeof(size_t));
+    char *buffs = malloc(count * buffer);
+    if (!runs || !heap || !buffs) {
+        perror("Error allocating memory");
+        fail();
+    }
+    size_t heap_size = 0;
+    for (size_t p = 0; p < count; ++p) {
+        runs[p] = (RunReader) { .fd = fd, .off = bounds[p], .end = bounds[p + 1], .buff = buffs + p * buffer,
+                                .capacity = buffer };
+        if (!runNext(&runs[p]))
+            continue;
+        size_t i = heap_size++;
+        for (; i > 0 && runs[heap[(i - 1) / 2]].rec.id > runs[p].rec.id; i = (i - 1) / 2)
+            heap[i] = heap[(i - 1) / 2];
+        heap[i] = p;
+    }
+    while (heap_size > 0) {
+        RunReader *c = &runs[heap[0]];
+        if (out) {
+            spillWrite(out->f, c->rec.id, c->line, c->rec.len);
+        } else {
+            if (c->rec.len)
+                fwrite(c->line, 1, c->rec.len, sink);
+            fputc('\n', sink);
+            ++stats->kept;
+        }
 
-    char *start = filebuff; 
-    char *ch = filebuff;
-    for (int j=0; j < buffsize; ++j, ++ch) {
-        if (isLineSep(*ch)) {
-            if (ch - start != 0) // Only count non-empty lines
-                ++line_count;
-            start = ch + 1;
+        size_t top = heap[0];
+        if (!runNext(c))
+            top = heap[--heap_size];
+        // Sift the new top down
+        uint64_t id = runs[top].rec.id;
+        size_t i = 0;
+        for (;;) {
+            size_t child = 2 * i + 1;
+            if (child >= heap_size)
+                break;
+            if (child + 1 < heap_size && runs[heap[child + 1]].rec.id < runs[heap[child]].rec.id)
+                ++child;
+            if (runs[heap[child]].rec.id >= id)
+                break;
+            heap[i] = heap[child];
+            i = child;
         }
+        if (heap_size > 0)
+            heap[i] = top;
     }
-    if (!isLineSep(*ch)) {  // If the file does not end in a newline
-        if (ch - start != 0)
-            ++line_count;
+
+    for (size_t p = 0; p < count; ++p)
+        free(runs[p].line);
+    free(buffs);
+    free(heap);
+    free(runs);
+}
+
+// Spills a line of stdin to its partition, if that is one of this pass
+static void graceSpillLine(Spill *lines, size_t first, size_t n, size_t partitions, const KeyField *line_key,
+                           uint64_t id, const char *line, size_t len)
+{
+    const char *key = line;
+    size_t key_len = len;
+    lineKey(line_key, &key, &key_len);
+    uint64_t hash = line_key->fold ? hashKeyFold(key, key_len) : hashKey(key, key_len);
+    size_t p = spillPartition(hash, partitions);
+    if (p >= first && p < first + n)
+        spillWrite(lines[p - first].f, id, line, len);
+}
+
+// Filters like parse(), but out of core (a grace hash join): the blacklist
+// and stdin are split into partitions by hash in temporary files, every
+// partition is filtered with an index of only its part of the blacklist,
+// and the kept lines are merged back into input order by line number.
+// Partitions past the fanout of the plan are split off in later passes
+// over the blacklist-files and the spilled stdin.
+void parseGrace(FILE *sink, int source, char **filenames, size_t count, const Selection *select,
+                const KeyField *list_key, const KeyField *line_key, uint32_t flags, const GracePlan *plan,
+                FilterStats *stats)
+{
+    const size_t partitions = plan->partitions, fanout = plan->fanout;
+    Spill *keys = malloc(fanout * sizeof(Spill));
+    Spill *lines = malloc(fanout * sizeof(Spill));
+    size_t *key_count = malloc(fanout * sizeof(size_t));
+    uint64_t *bounds = malloc((partitions + 1) * sizeof(uint64_t));
+    if (!keys || !lines || !key_count || !bounds) {
+        perror("Error allocating memory");
+        fail();
     }
-   
-    KeyHash *entries = malloc(line_count * sizeof(KeyHash));
-    fileHash->entries = entries;
-    
-    KeyHash *hashTable = NULL;
-    
-    KeyHash *entry;
-    size_t counter = 0;
-    start = ch = filebuff;
-    for (int j=0; j < buffsize; ++j, ++ch) {
-        if (!isLineSep(*ch))
+    const bool fold = line_key->fold;
+
+    // The kept lines of every partition, a run each in line number order
+    Spill kept;
+    spillOpen(&kept, plan->buffer);
+    // Stdin as it is, for the passes after the first
+    Spill input = { 0 };
+    if (partitions > fanout)
+        spillOpen(&input, plan->buffer);
+
+    for (size_t first = 0; first < partitions; first += fanout) {
+        const size_t n = partitions - first < fanout ? partitions - first : fanout;
+        for (size_t q = 0; q < n; ++q) {
+            spillOpen(&keys[q], plan->buffer);
+            spillOpen(&lines[q], plan->buffer);
+            key_count[q] = 0;
+        }
+
+        // Partition the blacklist files
+        for (size_t i = 0; i < count; ++i) {
+            int fd = open(filenames[i], O_RDONLY);
+            if (fd < 0) {
+                fprintf(stderr, "Error opening file %s: %s\n", filenames[i], strerror(errno));
+                fail();
+            }
+            LineReader r;
+            lineReaderInit(&r, filenames[i], fd, true, plan->block);
+            const char *line;
+            size_t len;
+            while (lineReaderNextUnordered(&r, &line, &len)) {
+                lineKey(list_key, &line, &len);
+                if (len == 0)
+                    continue;
+                size_t p = spillPartition(fold ? hashKeyFold(line, len) : hashKey(line, len), partitions);
+                if (p < first || p >= first + n)
+                    continue;
+                spillWrite(keys[p - first].f, i, line, len);
+                ++key_count[p - first];
+            }
+            freeLineReader(&r);
+            close(fd);
+        }
+
+        // Partition stdin, numbering the lines
+        if (first == 0) {
+            Chunk chunk = { .block = plan->block };
+            Carry carry = { 0 };
+            uint64_t seq = 0;
+            while (readChunk(source, &chunk, &carry)) {
+                stats->bytes += chunk.size;
+                LineScanner sc;
+                lineScannerInit(&sc, chunk.data, chunk.size, false);
+                for (size_t start = 0; start < chunk.size;) {
+                    size_t sep = nextLineSep(&sc);
+                    if (input.f)
+                        spillWrite(input.f, seq, chunk.data + start, sep - start);
+                    graceSpillLine(lines, first, n, partitions, line_key, seq++, chunk.data + start, sep - start);
+                    start = sep + 1;
+                }
+            }
+            freeChunk(&chunk);
+            free(carry.data);
+            stats->lines = seq;
+        } else {
+            rewind(input.f);
+            SpillRecord rec;
+            char *line = NULL;
+            size_t capacity = 0;
+            while (spillRead(input.f, &rec, &line, &capacity))
+                graceSpillLine(lines, first, n, partitions, line_key, rec.id, line, rec.len);
+            free(line);
+        }
+
+        // Filter every partition on its own
+        for (size_t q = 0; q < n; ++q) {
+            bounds[first + q] = spillTell(&kept);
+            size_t size = spillEnd(&keys[q]);
+            char *spill = "";
+            if (size > 0) {
+                // Keys are folded in place in the private mapping
+                spill = mmap(NULL, size, PROT_READ | (fold ? PROT_WRITE : 0), MAP_PRIVATE | MAP_POPULATE,
+                             fileno(keys[q].f), 0);
+                if (spill == MAP_FAILED) {
+                    perror("Error mapping a temporary file");
+                    fail();
+                }
+            }
+
+            KeySet set;
+            keySetInit(&set, spill, key_count[q]);
+            if (count > 1)
+                keySetInitMasks(&set);
+            for (size_t off = 0; off < size;) {
+                SpillRecord rec;
+                memcpy(&rec, spill + off, sizeof(rec));
+                off += sizeof(rec);
+                if (fold)
+                    foldInPlace(spill + off, rec.len);
+                uint64_t hash = hashKey(spill + off, rec.len);
+                if (set.masks)
+                    keySetInsertMask(&set, off, rec.len, hash, 1U << rec.id);
+                else
+                    keySetInsert(&set, off, rec.len, hash);
+                off += rec.len;
+            }
+
+            SeenSet seen;
+            if (flags & UNIQUE)
+                seenSetInit(&seen);
+
+            rewind(lines[q].f);
+            SpillRecord rec;
+            char *line = NULL;
+            size_t capacity = 0;
+            while (spillRead(lines[q].f, &rec, &line, &capacity)) {
+                const char *key = line;
+                size_t key_len = rec.len;
+                lineKey(line_key, &key, &key_len);
+                uint64_t hash = fold ? hashKeyFold(key, key_len) : hashKey(key, key_len);
+                const Slot *entry = keySetLookup(&set, key, key_len, hash, fold);
+                uint32_t mask = entry ? (set.masks ? set.masks[entry - set.slots] : 1) : 0;
+                bool listed = selectionMatch(select, mask);
+                if (( !(flags & WHITELIST) && listed) ||
+                    ( (flags & WHITELIST) && !listed) ) // Skip line if in blacklist
+                    continue;
+                // Equal lines are in the same partition, in input order
+                if (key_len != rec.len || fold)
+                    hash = hashKey(line, rec.len);
+                if ((flags & UNIQUE) && !seenSetInsert(&seen, line, rec.len, hash))
+                    continue;
+                spillWrite(kept.f, rec.id, line, rec.len);
+            }
+            free(line);
+            spillClose(&lines[q]);
+
+            if (flags & UNIQUE)
+                freeSeenSet(&seen);
+            freeKeySet(&set);
+            if (size > 0)
+                munmap(spill, size);
+            spillClose(&keys[q]);
+        }
+    }
+    bounds[partitions] = spillEnd(&kept);
+    if (input.f)
+        spillClose(&input);
+
+    // Merge the runs back into input order, at most fanout of them at once
+    size_t run_count = partitions;
+    while (run_count > fanout) {
+        Spill next;
+        spillOpen(&next, plan->buffer);
+        size_t merged = 0;
+        for (size_t i = 0; i < run_count; i += fanout) {
+            uint64_t start = spillTell(&next);
+            mergeRuns(fileno(kept.f), bounds + i, run_count - i < fanout ? run_count - i : fanout, plan->buffer,
+                      &next, NULL, stats);
+            bounds[merged++] = start;
+        }
+        bounds[merged] = spillEnd(&next);
+        spillClose(&kept);
+        kept = next;
+        run_count = merged;
+    }
+    mergeRuns(fileno(kept.f), bounds, run_count, plan->buffer, NULL, sink, stats);
+    fflush(sink);
+
+    spillClose(&kept);
+    free(bounds);
+    free(key_count);
+    free(keys);
+    free(lines);
+}
+
+#define PROBE_BUCKETS 7
+
+static const char *const probeBucketNames[PROBE_BUCKETS] = { "1", "2", "3", "4", "5-8", "9-16", "17+" };
+
+// How many keys of a hash table are found after reading 1, 2, ... slots,
+// false for the other kinds of index
+bool probeHistogram(const Index *index, size_t histogram[PROBE_BUCKETS], double *load_factor) {
+    uint32_t bits;
+    if (index->kind == INDEX_HASH)
+        bits = index->set.bits;
+    else if (index->kind == INDEX_INLINE)
+        bits = index->inlined.bits;
+    else
+        return false;
+
+    const size_t cap = (size_t)1 << bits;
+    memset(histogram, 0, PROBE_BUCKETS * sizeof(size_t));
+    for (size_t i = 0; i < cap; ++i) {
+        uint32_t tag = index->kind == INDEX_HASH ? index->set.slots[i].tag : inlineSlot(&index->inlined, i)->tag;
+        if (!tag)
             continue;
+        size_t probes = ((i - (tag >> (32 - bits))) & (cap - 1)) + 1;
+        ++histogram[probes <= 4 ? probes - 1 : probes <= 8 ? 4 : probes <= 16 ? 5 : 6];
+    }
+    *load_factor = (double)indexKeyCount(index) / cap;
+    return true;
+}
+
+// Prints the stats of the filter so far, and of the blacklist unless it is
+// NULL. Everything is computed here, so it costs nothing before.
+void printStats(FILE *sink, const Index *blacklist, const FilterStats *stats, StatsFormat format) {
+    const bool json = format == STATS_JSON;
+    const double seconds = stats->nanos / 1e9;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    if (json) {
+        fprintf(sink, "{\"lines\":%zu,\"kept\":%zu,\"dropped\":%zu,\"bytes\":%zu,\"seconds\":%.6f,"
+                "\"bytes_per_s\":%.0f,\"probes\":%zu,\"bloom_skipped\":%zu,\"uniq\":%zu,\"hash\":\"%s\"",
+                stats->lines, stats->kept, stats->lines - stats->kept, stats->bytes, seconds,
+                seconds > 0 ? stats->bytes / seconds : 0.0, stats->probes, stats->bloom_skipped, stats->uniq,
+                keyHash == HASH_CRC && !crcHardware ? "crc (table)" : hashNames[keyHash]);
+    } else {
+        fprintf(sink, "lines: %zu in, %zu kept, %zu dropped\n",
+                stats->lines, stats->kept, stats->lines - stats->kept);
+        if (seconds > 0)
+            fprintf(sink, "filter: %.3f s, %.1f MB/s, %.1f ns per line\n", seconds, stats->bytes / seconds / 1e6,
+                    stats->lines ? stats->nanos / (double)stats->lines : 0.0);
+        if (stats->uniq)
+            fprintf(sink, "uniq: %zu lines seen\n", stats->uniq);
+        fprintf(sink, "hash: %s%s\n", hashNames[keyHash], keyHash == HASH_CRC && !crcHardware ? " (no SSE4.2)" : "");
+    }
 
-        if (ch - start != 0) { // Skip empty lines
-            entries[counter].key = start;
-            *ch = '\0'; // TODO: Check for uniqueness
+    // --sorted and --memory-limit do without an index
+    if (blacklist && (blacklist->kind != INDEX_HASH || blacklist->set.slots)) {
+        const LoadStats *load = &blacklist->load;
+        const size_t keys = indexKeyCount(blacklist);
+        const size_t bloom_bytes = blacklist->bloom.block_count * BLOOM_BLOCK_WORDS * sizeof(uint32_t);
+        const bool exact = blacklist->kind != INDEX_TRIE && blacklist->kind != INDEX_PREFIX;
+        size_t histogram[PROBE_BUCKETS];
+        double load_factor;
+        const bool hashed = probeHistogram(blacklist, histogram, &load_factor);
 
-            HASH_FIND(hh, hashTable, start, ch-start, entry);
-            if (!entry) {
-                HASH_ADD_KEYPTR(hh, hashTable, start, ch-start, &entries[counter]);
-                ++counter;
+        if (json) {
+            fprintf(sink, ",\"load\":{\"read_s\":%.6f,\"hash_s\":%.6f,\"index_s\":%.6f,\"lines\":%zu,"
+                    "\"duplicates\":%zu}", load->read_ns / 1e9, load->hash_ns / 1e9, load->index_ns / 1e9,
+                    load->lines, load->lines > keys ? load->lines - keys : 0);
+            fprintf(sink, ",\"index\":{\"kind\":\"%s\",\"keys\":%zu", indexNames[blacklist->kind], keys);
+            if (exact)
+                fprintf(sink, ",\"bytes\":%zu", indexBytes(blacklist));
+            if (hashed) {
+                fprintf(sink, ",\"load_factor\":%.4f,\"probes\":{", load_factor);
+                for (int i = 0; i < PROBE_BUCKETS; ++i)
+                    fprintf(sink, "%s\"%s\":%zu", i ? "," : "", probeBucketNames[i], histogram[i]);
+                fputc('}', sink);
             }
+            fputc('}', sink);
+            if (bloom_bytes)
+                fprintf(sink, ",\"bloom_bytes\":%zu", bloom_bytes);
+            if (blacklist->delta.log.size)
+                fprintf(sink, ",\"delta_records\":%zu", blacklist->delta.records);
+        } else {
+            if (bloom_bytes) {
+                fprintf(sink, "bloom: %zu KiB, %zu of %zu exact probes avoided (%.1f%%)\n", bloom_bytes / 1024,
+                        stats->bloom_skipped, stats->lines,
+                        stats->lines ? 100.0 * stats->bloom_skipped / stats->lines : 0.0);
+            }
+            if (blacklist->delta.log.size)
+                fprintf(sink, "delta: %zu records on top of the compiled index\n", blacklist->delta.records);
+            fprintf(sink, "load: %.3f s reading, %.3f s hashing, %.3f s indexing", load->read_ns / 1e9,
+                    load->hash_ns / 1e9, load->index_ns / 1e9);
+            if (load->lines)
+                fprintf(sink, ", %zu lines, %zu duplicates dropped", load->lines,
+                        load->lines > keys ? load->lines - keys : 0);
+            fputc('\n', sink);
+            fprintf(sink, "index: %s of %zu keys", indexNames[blacklist->kind], keys);
+            if (exact)
+                fprintf(sink, ", %zu KiB", indexBytes(blacklist) / 1024);
+            if (hashed)
+                fprintf(sink, ", load factor %.2f", load_factor);
+            fputc('\n', sink);
+            if (hashed) {
+                fprintf(sink, "probes: keys found after");
+                for (int i = 0; i < PROBE_BUCKETS; ++i)
+                    fprintf(sink, "%s %s: %zu", i ? "," : "", probeBucketNames[i], histogram[i]);
+                fprintf(sink, " slots\n");
+            }
+            if (blacklist->kind == INDEX_INLINE)
+                fprintf(sink, "inline: slots of %u bytes, %zu keys too long for them\n",
+                        1U << blacklist->inlined.shift, blacklist->inlined.spilled);
+            if (blacklist->kind == INDEX_TRIE)
+                fprintf(sink, "substring: %zu keys in %zu states, %zu KiB\n", blacklist->trie.count,
+                        blacklist->trie.used, blacklist->trie.state_count * sizeof(TrieState) / 1024);
+        }
+    }
+
+    if (json) {
+        if (stats->partitions)
+            fprintf(sink, ",\"partitions\":%zu", stats->partitions);
+        fprintf(sink, ",\"peak_rss_kb\":%ld}\n", usage.ru_maxrss);
+    } else {
+        if (stats->partitions)
+            fprintf(sink, "out of core: %zu partitions\n", stats->partitions);
+        fprintf(sink, "memory: %ld KiB peak RSS\n", usage.ru_maxrss);
+    }
+    fflush(sink);
+}
+
+// Indexes blacklist files read into one buffer as readFiles does, every key
+// remembers which files it is in if there is more than one. Big files are
+// hashed on up to threads threads, see hashFilesParallel.
+void hashFiles(const FileBuffer *file, const size_t *starts, const size_t *sizes, size_t count, const KeyField *kf,
+               size_t threads, Index *index) {
+
+    // Keys are folded in place, only the pages with upper case get copied
+    if (kf->fold && file->size && mprotect((void *)file->data, file->size, PROT_READ | PROT_WRITE) != 0) {
+        perror("Error mapping file");
+        fail();
+    }
+
+    index->kind = INDEX_HASH;
+    index->file_count = count;
+    index->key.fold = kf->fold;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (threads > 1 && file->size >= PARALLEL_MIN_BYTES) {
+        index->load.lines = hashFilesParallel(file->data, starts, sizes, count, kf, &index->set, threads);
+        index->load.hash_ns = elapsedNanos(&start);
+        return;
+    }
+
+    size_t expected = 0;
+    for (size_t i = 0; i < count; ++i)
+        expected += estimateLines(file->data + starts[i], sizes[i]);
+    keySetInit(&index->set, file->data, expected);
+    if (count > 1)
+        keySetInitMasks(&index->set);
+    for (size_t i = 0; i < count; ++i)
+        index->load.lines += hashFile(file->data + starts[i], sizes[i], kf, &index->set, 1U << i);
+    index->load.hash_ns = elapsedNanos(&start);
+}
+
+// Reads and indexes the blacklist files
+void buildIndex(char **filenames, size_t count, const KeyField *kf, size_t threads, FileBuffer *file, Index *index) {
+    size_t starts[MAX_FILES];
+    size_t sizes[MAX_FILES];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    readFiles(filenames, count, file, starts, sizes);
+    index->load = (LoadStats) { .read_ns = elapsedNanos(&start) };
+    hashFiles(file, starts, sizes, count, kf, threads, index);
+}
+
+// Turns the hash set of a built index into the index the options ask for
+void indexApply(Index *index, const IndexOptions *options, FileBuffer *file) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (options->match != MATCH_EXACT) {
+        indexToMatch(index, options->match);
+        if (options->match == MATCH_SUBSTRING) // The automaton does not need the keys
+            freeFileBuffer(file);
+        else if (file->mapped)
+            madvise((void *)file->data, file->size, MADV_RANDOM);
+        index->load.index_ns = elapsedNanos(&start);
+        return;
+    }
+    if (options->mph)
+        indexToMph(index);
+    else
+        indexToKind(index, options->adapt ? indexChoose(&index->set) : options->kind);
+    if (options->bloom)
+        indexAddBloom(index, options->bloom);
+    if (file->mapped) // Lookups from here on are random accesses
+        madvise((void *)file->data, file->size, MADV_RANDOM);
+    index->load.index_ns = elapsedNanos(&start);
+}
+
+// Maps a compiled blacklist file, or reads and indexes the files
+void loadIndex(char **filenames, size_t count, const IndexOptions *options, FileBuffer *file, Index *index) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (count == 1 && isIndexFile(filenames[0])) {
+        mapIndex(filenames[0], file, index, options->verify);
+        loadDelta(filenames[0], ((const BlxHeader *)file->data)->data_checksum, index);
+        index->load.read_ns = elapsedNanos(&start);
+        return;
+    }
+    buildIndex(filenames, count, &options->key, options->threads, file, index);
+    indexApply(index, options, file);
+}
+
+// libblacklist, see blacklist.h
+
+struct blacklist_index {
+    Index index;
+    FileBuffer file;
+    bool whitelist;
+};
+
+// Serializes opening and closing, the hash of the keys can only change
+// while no index is open
+static pthread_mutex_t libraryLock = PTHREAD_MUTEX_INITIALIZER;
+static size_t libraryOpen = 0;
+
+// The options of the command for the blacklist_options of the library
+static void libraryOptions(const blacklist_options *lib, IndexOptions *options, KeyField *line_key) {
+    *options = (IndexOptions) {
+        .bloom = lib->bloom,
+        .verify = lib->verify,
+        .match = lib->match == BLACKLIST_SUBSTRING ? MATCH_SUBSTRING
+            : lib->match == BLACKLIST_PREFIX ? MATCH_PREFIX : MATCH_EXACT,
+        .key = {
+            .delim = lib->delimiter ? lib->delimiter : '\t',
+            .field = lib->list_field,
+            .crlf = lib->crlf,
+            .trim = lib->trim,
+            .fold = lib->ignore_case,
+        },
+        .adapt = !lib->bloom,
+    };
+    *line_key = options->key;
+    line_key->field = lib->field;
+}
+
+// Loads an index of the files, or of the buffer if there are none, the way
+// main does for the command
+static void libraryLoad(blacklist_index *bl, char **filenames, size_t count, const char *data, size_t size,
+                        const blacklist_options *lib) {
+    // What the flags of the command cannot express
+    const char *invalid = (unsigned)lib->match > BLACKLIST_PREFIX ? "unknown match"
+        : lib->delimiter == '\n' ? "the delimiter can not be a newline"
+        : lib->bloom > BLOOM_MAX_BITS ? "bloom is at most 64 bits per key"
+        : lib->bloom && lib->match != BLACKLIST_EXACT ? "bloom needs BLACKLIST_EXACT"
+        : NULL;
+    if (invalid) {
+        fprintf(stderr, "Error opening blacklist: %s\n", invalid);
+        fail();
+    }
+    IndexOptions options;
+    KeyField line_key;
+    libraryOptions(lib, &options, &line_key);
+    const bool compiled = count == 1 && isIndexFile(filenames[0]);
+    if (libraryOpen == 0) {
+        hashSelect(DEFAULT_HASH);
+        if (compiled)
+            blxHashSelect(filenames[0]);
+    }
+    if (count > MAX_FILES) {
+        fprintf(stderr, "Error opening blacklist: at most %d files are supported\n", MAX_FILES);
+        fail();
+    }
+    for (size_t i = 0; i < count && (count > 1 || options.match != MATCH_EXACT); ++i) {
+        if (isIndexFile(filenames[i])) {
+            fprintf(stderr, "Error loading index %s: it can neither be combined with other files nor "
+                    "match substrings or prefixes\n", filenames[i]);
+            fail();
         }
-        start = ch + 1;
-    } 
-    // If the file does not end in a newline
-    if (!isLineSep(*ch) && ch - start != 0) { 
-        entries[counter].key = start;
-        HASH_FIND(hh, hashTable, start, ch-start, entry);
-        if (!entry) {
-            HASH_ADD_KEYPTR(hh, hashTable, start, ch-start, &entries[counter]);
-            ++counter;
+    }
+
+    if (count > 0) {
+        loadIndex(filenames, count, &options, &bl->file, &bl->index);
+    } else {
+        bl->file = (FileBuffer) { .data = "" };
+        if (size > 0) {
+            char *copy = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (copy == MAP_FAILED) {
+                perror("Error mapping buffer");
+                fail();
+            }
+            memcpy(copy, data, size);
+            bl->file = (FileBuffer) { .data = copy, .size = size, .mapped = true };
         }
+        const size_t start = 0;
+        hashFiles(&bl->file, &start, &size, 1, &options.key, 1, &bl->index);
+        indexApply(&bl->index, &options, &bl->file);
     }
 
-    fileHash->hashTable = hashTable;
+    // A compiled index knows whether it was compiled with -i
+    if (line_key.fold && !bl->index.key.fold) {
+        fprintf(stderr, "Error loading index %s: ignore_case needs an index compiled with -i\n", filenames[0]);
+        fail();
+    }
+    line_key.fold |= bl->index.key.fold;
+    bl->index.key = line_key;
+    const uint32_t all_files = (uint32_t)((1ULL << bl->index.file_count) - 1);
+    if (lib->all)
+        bl->index.select.must = all_files;
+    else
+        bl->index.select.any = all_files;
+    bl->whitelist = lib->whitelist;
 }
- 
-// Function to print the contents of the hash table
-void printHashTable(const KeyHash *hashTable) {
-    const KeyHash *entry;
-    for (entry = hashTable; entry != NULL; entry = entry->hh.next) {
-        printf("Key: %s\n", entry->key);
+
+// libraryLoad as a call of the library, which returns NULL where the
+// command would exit
+static blacklist_index *libraryOpenIndex(char **filenames, size_t count, const char *data, size_t size,
+                                         const blacklist_options *lib) {
+    static const blacklist_options defaults = { 0 };
+    blacklist_index *volatile bl = calloc(1, sizeof(blacklist_index)); // Kept across the longjmp
+    if (!bl) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    pthread_mutex_lock(&libraryLock);
+    jmp_buf failed;
+    if (setjmp(failed)) {
+        failJump = NULL;
+        freeIndex(&bl->index);
+        freeFileBuffer(&bl->file);
+        free(bl);
+        pthread_mutex_unlock(&libraryLock);
+        return NULL;
     }
+    failJump = &failed;
+    libraryLoad(bl, filenames, count, data, size, lib ? lib : &defaults);
+    failJump = NULL;
+    ++libraryOpen;
+    pthread_mutex_unlock(&libraryLock);
+    return bl;
+}
+
+blacklist_index *blacklist_open(char **filenames, size_t count, const blacklist_options *options) {
+    return libraryOpenIndex(filenames, count, NULL, 0, options);
+}
+
+blacklist_index *blacklist_from_buffer(const char *data, size_t size, const blacklist_options *options) {
+    return libraryOpenIndex(NULL, 0, data, size, options);
 }
 
-// Function to free the memory used by the hash table
-void freeFileHash(FileHash *fileHash) {
-    KeyHash *current, *tmp;
+void blacklist_close(blacklist_index *index) {
+    if (!index)
+        return;
+    pthread_mutex_lock(&libraryLock);
+    freeIndex(&index->index);
+    freeFileBuffer(&index->file);
+    free(index);
+    --libraryOpen;
+    pthread_mutex_unlock(&libraryLock);
+}
+
+size_t blacklist_filter(const blacklist_index *index, const blacklist_line *lines, size_t count, uint64_t *keep) {
+    return filterBatch(&index->index, lines, count, keep, index->whitelist);
+}
+
+bool blacklist_contains(const blacklist_index *index, const char *line, size_t len) {
+    const blacklist_line one = { line, len };
+    uint64_t listed = 0;
+    return filterBatch(&index->index, &one, 1, &listed, true) > 0;
+}
 
-    HASH_ITER(hh, fileHash->hashTable, current, tmp) {
-        HASH_DEL(fileHash->hashTable, current);
+// Parses a --bytes range the way cut does, "N", "N-M", "N-" or "-M" with
+// bytes counted from 1
+bool parseByteRange(const char *range, KeyField *kf) {
+    char *end;
+    size_t from = 1, to = 0;
+    if (*range != '-') {
+        from = strtoull(range, &end, 10);
+        if (end == range || from == 0)
+            return false;
+        range = end;
+        to = *range ? 0 : from;
+    }
+    if (*range == '-' && range[1]) {
+        to = strtoull(range + 1, &end, 10);
+        if (end == range + 1 || *end || to < from)
+            return false;
+    } else if (*range && strcmp(range, "-") != 0) {
+        return false;
     }
-    free(fileHash->entries);
+    kf->from = from - 1;
+    kf->to = to;
+    return true;
 }
 
-#define MAX_LINE_LENGTH 1024
-#define UNIQUE  1
-#define WHITELIST  2
+// Parses a --select pattern, one of '+' (in), '-' (not in) and '.' (either)
+// for every blacklist file
+bool parseSelection(const char *pattern, uint32_t file_count, Selection *sel) {
+    *sel = (Selection) { 0 };
+    if (strlen(pattern) != file_count)
+        return false;
+    for (uint32_t i = 0; i < file_count; ++i) {
+        switch (pattern[i]) {
+        case '+': sel->must |= 1U << i; break;
+        case '-': sel->must_not |= 1U << i; break;
+        case '.': break;
+        default: return false;
+        }
+    }
+    return true;
+}
 
-void 
-parse(FILE *sink, FILE *source, FileHash *blacklist, uint32_t flags)
-{
-    char buffer[MAX_LINE_LENGTH];
+#define WATCH_SETTLE_MS 100
+
+// Loads the blacklist-files again for watchReload. An error does not end
+// the program as it would at start up: it is printed and NULL returned, the
+// stream goes on with the blacklist it has. What was allocated before
+// running out of memory may leak.
+static Blacklist *watchLoad(Watch *w) {
+    Blacklist *volatile next = calloc(1, sizeof(Blacklist)); // Kept across the longjmp
+    if (!next) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    jmp_buf failed;
+    if (setjmp(failed)) {
+        failJump = NULL;
+        freeBlacklist(next);
+        return NULL;
+    }
+    failJump = &failed;
+    if (w->count == 1 && isIndexFile(w->filenames[0])) {
+        BlxHeader header;
+        readIndexHeader(w->filenames[0], &header);
+        if (header.flags >> BLX_HASH_SHIFT != keyHash) {
+            fprintf(stderr, "WARNING: %s: recompiled with another hash, not reloaded\n", w->filenames[0]);
+            fail();
+        }
+    }
+    loadIndex(w->filenames, w->count, &w->options, &next->file, &next->index);
+    failJump = NULL;
+    return next;
+}
 
-    KeyHash *hashTable = NULL;
-    KeyHash *entry;
+// Rebuilds the blacklist, swaps it in and frees the old one once no reader
+// can use it anymore
+static void watchReload(Watch *w, const struct timespec *changed) {
+    for (size_t i = 0; i < w->count; ++i) {
+        if (access(w->filenames[i], R_OK) != 0) { // Removed, wait for it to come back
+            fprintf(stderr, "WARNING: %s: %s, not reloaded\n", w->filenames[i], strerror(errno));
+            return;
+        }
+    }
+
+    atomic_store(&w->reloading, true);
+    Blacklist *old = atomic_load(&w->current);
+    Blacklist *next = watchLoad(w);
+    if (!next) {
+        fprintf(stderr, "WARNING: %s: not reloaded, still filtering with the blacklist loaded before\n",
+                w->filenames[0]);
+        atomic_store(&w->reloading, false);
+        return;
+    }
+    if (next->index.file_count != old->index.file_count) {
+        fprintf(stderr, "WARNING: %s: the number of files it was compiled from changed, not reloaded\n",
+                w->filenames[0]);
+        freeBlacklist(next);
+        atomic_store(&w->reloading, false);
+        return;
+    }
+    next->index.select = old->index.select;
+    next->index.key = old->index.key;
 
-    char *line = NULL;
-    size_t len = 0;
+    atomic_store(&w->current, next);
+    uint64_t epoch = atomic_fetch_add(&w->epoch, 1) + 1;
+    double latency = elapsedNanos(changed) / 1e6;
 
-    // Read lines from stdin until EOF is encountered
-    while (getline(&line, &len, stdin) != -1) {
-        // Remove newline character
-        size_t line_len = strlen(line);
-        if (line_len > 0 && line[line_len - 1] == '\n') {
-            line[line_len - 1] = '\0';
-            line_len--;
+    // Readers online in an older epoch may still use the old blacklist
+    struct timespec grace;
+    clock_gettime(CLOCK_MONOTONIC, &grace);
+    for (size_t i = 0; i < w->reader_count; ++i) {
+        for (;;) {
+            uint64_t seen = atomic_load(&w->readers[i].epoch);
+            if (seen == 0 || seen >= epoch)
+                break;
+            nanosleep(&(struct timespec) { .tv_nsec = 100000 }, NULL);
         }
+    }
+    double grace_ms = elapsedNanos(&grace) / 1e6;
+    freeBlacklist(old);
+    atomic_store(&w->reloading, false);
 
-        HASH_FIND(hh, blacklist->hashTable, line, line_len, entry);
-        if (( !(flags & WHITELIST) && entry) ||
-            ( (flags & WHITELIST) && !entry) ) // Skip line if in blacklist
-            continue;
+    ++w->reloads;
+    w->last_ms = latency;
+    w->max_ms = latency > w->max_ms ? latency : w->max_ms;
+    w->grace_ms += grace_ms;
+    if (w->stats == STATS_JSON)
+        fprintf(stderr, "{\"reload\":{\"keys\":%zu,\"swap_ms\":%.3f,\"grace_ms\":%.3f}}\n",
+                indexKeyCount(&next->index), latency, grace_ms);
+    else if (w->stats)
+        fprintf(stderr, "reload: %zu keys, swapped %.1f ms after the change, %.2f ms waiting for readers\n",
+                indexKeyCount(&next->index), latency, grace_ms);
+}
 
-        HASH_FIND(hh, hashTable, line, line_len, entry);
-        if (entry) { // Line already printed
-            if (flags & UNIQUE)
+static void *watchThread(void *arg) {
+    Watch *w = arg;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        struct pollfd fds[2] = { { .fd = w->inotify, .events = POLLIN }, { .fd = w->stop[0], .events = POLLIN } };
+        // The stream goes on with the blacklist it has if watching fails
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
                 continue;
-        } 
-        else {
-            entry = malloc(sizeof(KeyHash));
-            entry->key = line;
+            fprintf(stderr, "WARNING: stopped watching the blacklist-files: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        // Files are often written in several steps, wait until they settle
+        struct timespec changed;
+        clock_gettime(CLOCK_MONOTONIC, &changed);
+        bool ours = false;
+        int error = 0;
+        do {
+            ssize_t n = read(w->inotify, events, sizeof(events));
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                error = errno;
+                break;
+            }
+            for (ssize_t off = 0; off < n;) {
+                const struct inotify_event *event = (const struct inotify_event *)(events + off);
+                off += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) // Events were lost, one may have been ours
+                    ours = true;
+                for (size_t i = 0; i < w->count && event->len; ++i) {
+                    const char *name = strrchr(w->filenames[i], '/');
+                    name = name ? name + 1 : w->filenames[i];
+                    size_t len = strlen(name);
+                    if (event->wd == w->watches[i] && strncmp(event->name, name, len) == 0
+                        && (!event->name[len] || strcmp(event->name + len, ".delta") == 0))
+                        ours = true;
+                }
+            }
+        } while (poll(fds, 1, WATCH_SETTLE_MS) > 0);
 
-            HASH_ADD_KEYPTR(hh, hashTable, entry->key, line_len, entry);
+        if (ours)
+            watchReload(w, &changed);
+        if (error) {
+            fprintf(stderr, "WARNING: stopped watching the blacklist-files: %s\n", strerror(error));
+            break;
         }
+    }
+    return NULL;
+}
 
-        fprintf(sink, "%s\n", line);
+// Takes over the loaded blacklist and starts watching its files
+void watchStart(Watch *w, char **filenames, size_t count, Blacklist *current, size_t readers) {
+    w->filenames = filenames;
+    w->count = count;
+    w->current = current;
+    w->epoch = 1;
+    w->reader_count = readers;
+    w->readers = aligned_alloc(_Alignof(RcuReader), readers * sizeof(RcuReader));
+    w->watches = calloc(count, sizeof(int));
+    if (!w->readers || !w->watches) {
+        perror("Error allocating memory");
+        fail();
+    }
+    memset(w->readers, 0, readers * sizeof(RcuReader));
+
+    // Watch the directories, an editor often replaces a file by renaming
+    w->inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (w->inotify < 0 || pipe(w->stop) < 0) {
+        perror("Error watching the blacklist-files");
+        fail();
+    }
+    for (size_t i = 0; i < count; ++i) {
+        const char *slash = strrchr(filenames[i], '/');
+        char *dir = slash ? strndup(filenames[i], slash - filenames[i] + 1) : strdup(".");
+        w->watches[i] = inotify_add_watch(w->inotify, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (w->watches[i] < 0) {
+            fprintf(stderr, "Error watching %s: %s\n", dir, strerror(errno));
+            fail();
+        }
+        free(dir);
     }
+    pthread_create(&w->thread, NULL, watchThread, w);
+}
+
+// Stops watching, the current blacklist stays loaded
+void watchStop(Watch *w) {
+    close(w->stop[1]);
+    pthread_join(w->thread, NULL);
+    close(w->stop[0]);
+    close(w->inotify);
+    free(w->watches);
+}
 
+void printWatchStats(FILE *sink, const Watch *w, StatsFormat format) {
+    size_t lines[2] = { 0 };
+    uint64_t nanos[2] = { 0 };
+    for (size_t i = 0; i < w->reader_count; ++i) {
+        for (int j = 0; j < 2; ++j) {
+            lines[j] += w->readers[i].lines[j];
+            nanos[j] += w->readers[i].nanos[j];
+        }
+    }
+    if (format == STATS_JSON) {
+        fprintf(sink, "{\"watch\":{\"reloads\":%zu,\"last_ms\":%.3f,\"max_ms\":%.3f,\"grace_ms\":%.3f,"
+                "\"reloading_lines\":%zu,\"reloading_ns\":%" PRIu64 ",\"lines\":%zu,\"ns\":%" PRIu64 "}}\n",
+                w->reloads, w->last_ms, w->max_ms, w->grace_ms, lines[1], nanos[1], lines[0], nanos[0]);
+        return;
+    }
+    fprintf(sink, "watch: %zu reloads, last %.1f ms and at most %.1f ms from the change to the swap, "
+            "%.2f ms waiting for readers\n", w->reloads, w->last_ms, w->max_ms, w->grace_ms);
+    fprintf(sink, "watch: %.1f ns per line while reloading (%zu lines), %.1f ns otherwise (%zu lines)\n",
+            lines[1] ? (double)nanos[1] / lines[1] : 0.0, lines[1],
+            lines[0] ? (double)nanos[0] / lines[0] : 0.0, lines[0]);
+}
 
-    KeyHash *current, *tmp;
-    HASH_ITER(hh, hashTable, current, tmp) {
-        HASH_DEL(hashTable, current);
-        free(current);
+// Prints the throughput of every hash for keys of path length and for
+// long lines, see --hash-bench
+void hashBench(FILE *sink) {
+    static const size_t lengths[] = { 24, 1024 };
+    const size_t total = 1 << 28; // Bytes hashed per run
+    char *buff = malloc(total + 1024);
+    if (!buff) {
+        perror("Error allocating memory");
+        fail();
+    }
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < total + 1024; ++i) {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        buff[i] = 'a' + x % 26;
     }
 
-    free(line);
+    fprintf(sink, "%-12s %14s %14s\n", "hash", "24 B (MB/s)", "1 KiB (MB/s)");
+    for (int h = 0; h < HASH_COUNT; ++h) {
+        for (int hardware = h == HASH_CRC ? crcHardware : 0; hardware >= 0; --hardware) {
+            fprintf(sink, "%-12s", h == HASH_CRC ? (hardware ? "crc" : "crc (table)") : hashNames[h]);
+            for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+                size_t len = lengths[l];
+                uint64_t sum = 0;
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                // Keys overlap by a few bytes, like the lines of a chunk
+                for (size_t off = 0; off + len <= total; off += len - 3) {
+                    if (h == HASH_CRC)
+                        sum += hardware ? hashCrcHardware(buff + off, len, false) : hashCrcTable(buff + off, len, false);
+                    else
+                        sum += hashWith(h, buff + off, len, false);
+                }
+                double seconds = elapsedNanos(&start) / 1e9;
+                volatile uint64_t used = sum; // Keeps the hashing from being optimized out
+                (void)used;
+                fprintf(sink, " %14.0f", total / seconds / 1e6);
+            }
+            fputc('\n', sink);
+        }
+    }
+    free(buff);
 }
 
+#ifndef BLACKLIST_LIBRARY
 int main(int argc, char *argv[]) {
 
     const char *program = *argv;
@@ -205,6 +5366,52 @@ int main(int argc, char *argv[]) {
     bool *help = flag_bool("help", 'h', "Print this help to stdout and exit with 0");
     bool *uniq = flag_bool("uniq", 'u', "Print a line only the first time it occurs");
     bool *whitelist = flag_bool("whitelist", 'w', "Argument file is a whilelist in stead of a blacklist");
+    uint64_t *jobs = flag_uint64("jobs", 1, "Number of threads filtering stdin and hashing big blacklist-files, "
+                                 "0 for one per CPU");
+    flag_set_char_name(jobs, 'j');
+    bool *compile = flag_bool("compile", 0, "Compile the blacklist-file into an index file given by -o and exit");
+    char **output = flag_str("output", NULL, "Output file of --compile");
+    flag_set_char_name(output, 'o');
+    bool *verify = flag_bool("verify", 0, "Check the checksum of a compiled blacklist-file before using it");
+    bool *mph = flag_bool("mph", 0, "Index the blacklist with a perfect hash, best for --compile of a static list");
+    uint64_t *bloom = flag_uint64("bloom", 0, "Bits per key of a Bloom filter in front of the index, 0 for none, at most 64");
+    char **stats = flag_opt_str("stats", "text", "Print statistics to stderr at exit, --stats=json prints them as a "
+                                "JSON object");
+    uint64_t *stats_interval = flag_uint64("stats-interval", 0, "Also print the statistics every this many seconds "
+                                           "while filtering, 0 for only at exit");
+    bool *all = flag_bool("all", 0, "A line only counts as listed if it is in all blacklist-files");
+    char **select = flag_str("select", NULL, "Which blacklist-files a listed line is in, one char per file: "
+                             "'+' in, '-' not in, '.' either. E.g. '+-' for in the first but not the second");
+    bool *sorted = flag_bool("sorted", 0, "Stdin and the blacklist-files are sorted (LC_ALL=C sort), "
+                             "merge them in constant memory instead of building an index");
+    size_t *memory_limit = flag_size("memory-limit", 0, "Memory of the process, e.g. 512M. A blacklist that needs more "
+                                     "is filtered out of core through temporary files in $TMPDIR, 0 for no limit");
+    bool *watch = flag_bool("watch", 0, "Reload the blacklist-files when they change, for filtering an endless stream");
+    bool *add = flag_bool("add", 0, "Add the lines of stdin to a compiled blacklist-file through its delta log and exit, "
+                          "to the files marked '+' by --select if it was compiled from several");
+    bool *remove = flag_bool("remove", 0, "Same as --add, but removes the lines");
+    bool *substring = flag_bool("substring", 0, "A line is listed if it contains a line of a blacklist-file");
+    bool *prefix = flag_bool("prefix", 0, "A line is listed if it starts with a line of a blacklist-file");
+    bool *compact = flag_bool("compact", 0, "Fold the delta log of a compiled blacklist-file into it and exit, "
+                              "not while lines are added");
+    uint64_t *field = flag_uint64("field", 0, "Only match this field (from 1) of a line of stdin, the whole line "
+                                  "is still printed. 0 for the whole line");
+    flag_set_char_name(field, 'f');
+    char **delimiter = flag_str("delimiter", "\\t", "Field delimiter of --field and --list-field, a single character");
+    flag_set_char_name(delimiter, 'd');
+    char **bytes = flag_str("bytes", NULL, "Only match these bytes of a line of stdin, or of its --field, "
+                            "e.g. 1-8, 5-, -8 or 3");
+    flag_set_char_name(bytes, 'b');
+    uint64_t *list_field = flag_uint64("list-field", 0, "Only index this field (from 1) of a line of a blacklist-file, "
+                                       "0 for the whole line");
+    bool *ignore_case = flag_bool("ignore-case", 'i', "Ignore ASCII case, a compiled blacklist-file remembers it");
+    bool *trim = flag_bool("trim", 0, "Ignore white space around lines, or their --field, of stdin and the blacklist-files");
+    char **hash = flag_str("hash", DEFAULT_HASH, "Hash of the keys, fnv, wy, crc or auto for the fastest the CPU has. "
+                           "A compiled blacklist-file uses the one it was compiled with");
+    bool *hash_bench = flag_bool("hash-bench", 0, "Print the throughput of every hash and exit");
+    bool *crlf = flag_bool("crlf", 0, "Ignore a '\\r' at the end of lines of stdin and the blacklist-files");
+    char **index_kind = flag_str("index", "auto", "Exact match index of plain blacklist-files, small (scanned), sorted "
+                                 "(binary search), hash, inline (hash with the keys in the slots) or auto to pick one by the number and lengths of the keys");
     
     if (!flag_parse(argc, argv)) {
         usage(stderr, program);
@@ -223,18 +5430,289 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     } */ 
 
-    FileHash blacklist = { 0 };
-    if (argv[0]) {
-        const char *filename = argv[0];
+    if (!hashSelect(*hash)) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: --hash needs one of fnv, wy, crc or auto\n");
+        exit(1);
+    }
+    if (*hash_bench) {
+        hashBench(stdout);
+        exit(0);
+    }
+
+    StatsFormat stats_format = STATS_OFF;
+    if (*stats && strcmp(*stats, "text") != 0 && strcmp(*stats, "json") != 0) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: --stats is text or json\n");
+        exit(1);
+    }
+    if (*stats || *stats_interval)
+        stats_format = *stats && strcmp(*stats, "json") == 0 ? STATS_JSON : STATS_TEXT;
+
+    size_t file_count = flag_rest_argc();
+    // The format is only taken after '=', blacklist-files and flags mix
+    for (size_t i = 0; *stats && i < file_count; ++i) {
+        if (strcmp(argv[i], "text") == 0 || strcmp(argv[i], "json") == 0) {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: give the format as --stats=%s, or the blacklist-file as ./%s\n", argv[i], argv[i]);
+            exit(1);
+        }
+    }
+    if (file_count > MAX_FILES) {
+        fprintf(stderr, "ERROR: at most %d blacklist-files are supported\n", MAX_FILES);
+        exit(1);
+    }
+    for (size_t i = 0; i < file_count && file_count > 1; ++i) {
+        if (isIndexFile(argv[i])) {
+            fprintf(stderr, "ERROR: %s: a compiled blacklist-file can not be combined with others, "
+                    "compile them together instead\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (file_count == 1 && isIndexFile(argv[0]))
+        blxHashSelect(argv[0]);
+
+    bool tab = strcmp(*delimiter, "\\t") == 0;
+    char delim = tab ? '\t' : **delimiter;
+    if (!delim || (!tab && (*delimiter)[1])) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: --delimiter needs a single character\n");
+        exit(1);
+    }
+    KeyField list_key = { .delim = delim, .field = *list_field, .crlf = *crlf, .trim = *trim, .fold = *ignore_case };
+    KeyField line_key = list_key;
+    line_key.field = *field;
+    if (*bytes && !parseByteRange(*bytes, &line_key)) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: --bytes needs a range of bytes from 1, e.g. 1-8, 5-, -8 or 3\n");
+        exit(1);
+    }
+    if (*sorted && (!keyFieldWhole(&line_key) || !keyFieldWhole(&list_key) || line_key.fold)) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: --sorted merges whole lines, not --field, --bytes, --list-field, --trim, --crlf or -i\n");
+        exit(1);
+    }
+
+    if (*add || *remove || *compact) {
+        if (*add + *remove + *compact > 1 || file_count != 1 || !isIndexFile(argv[0])) {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: --add, --remove and --compact need a single compiled blacklist-file\n");
+            exit(1);
+        }
+        if (*compact) {
+            Index index = { 0 };
+            FileBuffer file = { 0 };
+            loadIndex(argv, 1, &(IndexOptions) { .verify = *verify }, &file, &index);
+            if (index.delta.log.size) {
+                indexFoldDelta(&index, &file);
+                compileIndex(&index, argv[0]);
+            }
+            char *path = deltaPath(argv[0]);
+            if (unlink(path) != 0 && errno != ENOENT) {
+                perror("Error removing delta log");
+                exit(EXIT_FAILURE);
+            }
+            free(path);
+            freeIndex(&index);
+            freeFileBuffer(&file);
+            return EXIT_SUCCESS;
+        }
+
+        BlxHeader header;
+        readIndexHeader(argv[0], &header);
+        uint32_t mask = (uint32_t)((1ULL << header.file_count) - 1);
+        Selection sel;
+        if (*select) {
+            if (!parseSelection(*select, header.file_count, &sel) || sel.must_not) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: --select of --add and --remove needs one of '+.' per file of the index\n");
+                exit(1);
+            }
+            mask = sel.must;
+        }
+        appendDelta(argv[0], *add ? DELTA_ADD : DELTA_REMOVE, mask, &list_key, STDIN_FILENO);
+        return EXIT_SUCCESS;
+    }
+
+    if (*jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        *jobs = cpus > 0 ? cpus : 1;
+    }
+    IndexOptions options = {
+        .mph = *mph,
+        .bloom = *bloom,
+        .verify = *verify,
+        .match = *substring ? MATCH_SUBSTRING : *prefix ? MATCH_PREFIX : MATCH_EXACT,
+        .key = list_key,
+        // The others can neither be compiled nor have a Bloom filter
+        .adapt = strcmp(*index_kind, "auto") == 0 && !*compile && !*bloom,
+        .kind = strcmp(*index_kind, "small") == 0 ? INDEX_SMALL
+            : strcmp(*index_kind, "sorted") == 0 ? INDEX_SORTED
+            : strcmp(*index_kind, "inline") == 0 ? INDEX_INLINE : INDEX_HASH,
+        .threads = *jobs,
+    };
+    if (strcmp(*index_kind, "auto") != 0 && strcmp(*index_kind, "hash") != 0 && (options.kind == INDEX_HASH
+            || options.match != MATCH_EXACT || *mph || *bloom || *compile || *sorted || *memory_limit
+            || (file_count == 1 && isIndexFile(argv[0])))) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: --index is auto, small, sorted, hash or inline, small, sorted and inline need plain blacklist-files "
+                "and exclude --substring, --prefix, --mph, --bloom, --compile, --sorted and --memory-limit\n");
+        exit(1);
+    }
+    if (*bloom > BLOOM_MAX_BITS) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: --bloom is at most %d bits per key\n", BLOOM_MAX_BITS);
+        exit(1);
+    }
+    if (options.match != MATCH_EXACT && (*substring + *prefix > 1 || *mph || *bloom || *compile || *sorted
+            || *memory_limit || (file_count == 1 && isIndexFile(argv[0])))) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: --substring and --prefix need plain blacklist-files and exclude each other, "
+                "--mph, --bloom, --compile, --sorted and --memory-limit\n");
+        exit(1);
+    }
+    if (*memory_limit && (*mph || *bloom || *jobs != 1)) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: --memory-limit excludes --mph, --bloom and --jobs\n");
+        exit(1);
+    }
+
+    // A compiled blacklist-file is mapped, the kernel pages it in and out
+    GracePlan plan = { .partitions = 1 };
+    if (*memory_limit && !*sorted && !*compile && file_count > 0 && !isIndexFile(argv[0]))
+        gracePlan(argv, file_count, *memory_limit, &plan);
+    const size_t partitions = plan.partitions;
+
+    Index blacklist = { 0 };
+    FileBuffer file = { 0 };
+    if (*sorted) {
+        if (*compile) {
+            fprintf(stderr, "ERROR: --sorted does not build an index to --compile\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < file_count; ++i) {
+            if (isIndexFile(argv[i])) {
+                fprintf(stderr, "ERROR: %s: --sorted needs the plain blacklist-file\n", argv[i]);
+                exit(1);
+            }
+        }
+        blacklist.file_count = file_count > 0 ? file_count : 1;
+    } else if (partitions > 1) {
+        blacklist.file_count = file_count;
+    } else if (file_count > 0) {
+        loadIndex(argv, file_count, &options, &file, &blacklist);
+    } else { // Nothing is listed
+        blacklist.file_count = 1;
+        keySetInit(&blacklist.set, NULL, 0);
+    }
+
+    const uint32_t all_files = (uint32_t)((1ULL << blacklist.file_count) - 1);
+    if (*select) {
+        if (*all || !parseSelection(*select, blacklist.file_count, &blacklist.select)) {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: --select needs one of '+-.' per blacklist-file and excludes --all\n");
+            exit(1);
+        }
+    } else if (*all) {
+        blacklist.select.must = all_files;
+    } else {
+        blacklist.select.any = all_files;
+    }
+    // A compiled blacklist-file knows whether it was compiled with -i
+    if (line_key.fold && !blacklist.key.fold && file_count == 1 && isIndexFile(argv[0])) {
+        fprintf(stderr, "ERROR: %s: -i needs a blacklist-file compiled with -i\n", argv[0]);
+        exit(1);
+    }
+    line_key.fold |= blacklist.key.fold;
+    blacklist.key = line_key;
+
+    if (*compile) {
+        if (!argv[0] || !*output) {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: --compile needs a blacklist-file and -o <index-file>\n");
+            exit(1);
+        }
+        if (blacklist.delta.log.size)
+            indexFoldDelta(&blacklist, &file);
+        compileIndex(&blacklist, *output);
+        freeIndex(&blacklist);
+        freeFileBuffer(&file);
+        return EXIT_SUCCESS;
+    }
 
-        size_t file_size;
-        char *filebuff = readFile(filename, &file_size);
-        hashFile(filebuff, file_size, &blacklist);
+    if (*watch && (*sorted || partitions > 1 || file_count == 0)) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: --watch needs a blacklist-file and an index, not --sorted or --memory-limit\n");
+        exit(1);
     }
 
     uint32_t flags = *uniq * UNIQUE + *whitelist * WHITELIST;
-    parse(stdout, stdin, &blacklist, flags);
+    if (*sorted) {
+        FilterStats filter_stats = { 0 };
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        parseSorted(stdout, STDIN_FILENO, argv, file_count, &blacklist.select, flags, &filter_stats);
+        filter_stats.nanos = elapsedNanos(&start);
+        if (stats_format)
+            printStats(stderr, &blacklist, &filter_stats, stats_format);
+        return EXIT_SUCCESS;
+    }
+    if (partitions > 1) {
+        FilterStats filter_stats = { .partitions = partitions };
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        parseGrace(stdout, STDIN_FILENO, argv, file_count, &blacklist.select, &options.key, &blacklist.key,
+                   flags, &plan, &filter_stats);
+        filter_stats.nanos = elapsedNanos(&start);
+        if (stats_format)
+            printStats(stderr, &blacklist, &filter_stats, stats_format);
+        return EXIT_SUCCESS;
+    }
+
+    Watch watcher = { .options = options, .stats = stats_format };
+    if (*watch) {
+        Blacklist *current = malloc(sizeof(Blacklist));
+        if (!current) {
+            perror("Error allocating memory");
+            exit(EXIT_FAILURE);
+        }
+        *current = (Blacklist) { .index = blacklist, .file = file };
+        watchStart(&watcher, argv, file_count, current, *jobs);
+    }
+
+    FilterStats filter_stats = { 0 };
+    StatsReport report = {
+        .format = stats_format,
+        .interval_ns = *stats_interval * 1000000000ULL,
+        .next_ns = *stats_interval * 1000000000ULL,
+        .blacklist = *watch ? NULL : &blacklist,
+    };
+    clock_gettime(CLOCK_MONOTONIC, &report.start);
+    StatsReport *reporting = *stats_interval ? &report : NULL;
+    if (*jobs > 1)
+        parseParallel(STDOUT_FILENO, STDIN_FILENO, &blacklist, *watch ? &watcher : NULL, flags, *jobs, reporting,
+                      &filter_stats);
+    else
+        parse(STDOUT_FILENO, STDIN_FILENO, &blacklist, *watch ? &watcher : NULL, flags, reporting, &filter_stats);
+    filter_stats.nanos = elapsedNanos(&report.start);
+
+    if (*watch) {
+        watchStop(&watcher);
+        Blacklist *current = atomic_load(&watcher.current);
+        if (stats_format) {
+            printStats(stderr, &current->index, &filter_stats, stats_format);
+            printWatchStats(stderr, &watcher, stats_format);
+        }
+        freeBlacklist(current);
+        free(watcher.readers);
+        return EXIT_SUCCESS;
+    }
+
+    if (stats_format)
+        printStats(stderr, &blacklist, &filter_stats, stats_format);
 
-    freeFileHash(&blacklist);
+    freeIndex(&blacklist);
+    freeFileBuffer(&file);
     return EXIT_SUCCESS;
 }
+#endif
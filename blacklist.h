@@ -0,0 +1,94 @@
+// blacklist.h -- libblacklist, the index of blacklist for use in a program
+//
+// A blacklist_index is built from blacklist files, a compiled index file
+// or a buffer, and then filters lines handed to it in batches, without a
+// pipe to the command in between:
+//
+//     blacklist_index *bl = blacklist_open(&path, 1, NULL);
+//     uint64_t keep[(count + 63) / 64];
+//     blacklist_filter(bl, lines, count, keep);
+//     ...
+//     blacklist_close(bl);
+//
+// Any number of threads may filter with the same index at once, an index
+// does not change after it has been opened. Opening and closing is
+// serialized within the library.
+//
+// A call that fails prints why to stderr, the way the command does, and
+// returns NULL, options out of range included; there is no other way to
+// get the error. What it allocated before running out of memory may leak.
+// The library starts no threads of its own, an index is built on the
+// thread that opens it.
+//
+// The hash of the keys is one for the whole process: the first index
+// opened while none is open picks it, a compiled index file the hash it
+// was compiled with (--hash). Files and buffers opened after it are hashed
+// the same, a compiled index file has to match it. So two compiled index
+// files built with a different --hash can not be open at once, opening the
+// second fails until the first is closed.
+//
+// Link with -lblacklist -pthread, see make lib.
+#ifndef BLACKLIST_H_
+#define BLACKLIST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BLACKLIST_API __attribute__((visibility("default")))
+
+typedef struct blacklist_index blacklist_index;
+
+typedef enum {
+    BLACKLIST_EXACT = 0,
+    BLACKLIST_SUBSTRING,    // A line is listed if it contains a key, --substring
+    BLACKLIST_PREFIX,       // A line is listed if it starts with a key, --prefix
+} blacklist_match;
+
+// The options of the command by the same names, all 0 are its defaults.
+// A compiled index remembers ignore_case and its keys.
+typedef struct {
+    blacklist_match match;
+    bool whitelist;         // Keep the listed lines and drop the others
+    bool all;               // A line is listed only if it is in all files
+    bool ignore_case;
+    bool trim;
+    bool crlf;
+    size_t field;           // Of the lines filtered, from 1, 0 for the whole line
+    size_t list_field;      // Of the lines of the files
+    char delimiter;         // Of both fields, 0 for a tab, not a newline
+    uint64_t bloom;         // Bits per key of a Bloom filter, 0 for none, at most 64
+    bool verify;            // Checksum a compiled index before using it
+} blacklist_options;
+
+typedef struct {
+    const char *data;
+    size_t len;             // Without the newline
+} blacklist_line;
+
+// Indexes the lines of up to 32 blacklist files, or maps a single compiled
+// index file. options may be NULL.
+BLACKLIST_API blacklist_index *blacklist_open(char **filenames, size_t count, const blacklist_options *options);
+
+// Indexes the lines of a buffer, which is copied and can be freed afterwards
+BLACKLIST_API blacklist_index *blacklist_from_buffer(const char *data, size_t size, const blacklist_options *options);
+
+BLACKLIST_API void blacklist_close(blacklist_index *index);
+
+// Sets bit i % 64 of keep[i / 64] if line i is kept and clears it if it is
+// dropped. Returns the number of lines kept.
+BLACKLIST_API size_t blacklist_filter(const blacklist_index *index, const blacklist_line *lines, size_t count,
+                                      uint64_t *keep);
+
+// Whether the line is listed, whitelist or not
+BLACKLIST_API bool blacklist_contains(const blacklist_index *index, const char *line, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BLACKLIST_H_
@@ -0,0 +1,136 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blacklist.h"
+
+#define FLAG_IMPLEMENTATION
+#include "flag.h"
+
+void usage(FILE *sink, const char *program)
+{
+    fprintf(sink, "Usage: %s [OPTIONS] [--] <blacklist-file>...\n\n", program);
+    fprintf(sink, "    blacklist-file: filters stdin with libblacklist and prints the kept lines, the way the\n");
+    fprintf(sink, "                    command does, for check.sh to compare the two\n\n");
+    fprintf(sink, "OPTIONS:\n");
+    flag_print_options(sink);
+}
+
+// Reads all of a stream into the heap, *size is set to its length
+static char *readAll(FILE *f, size_t *size) {
+    size_t capacity = 1 << 16;
+    char *buff = malloc(capacity);
+    *size = 0;
+    for (;;) {
+        if (!buff) {
+            perror("Error allocating memory");
+            exit(EXIT_FAILURE);
+        }
+        *size += fread(buff + *size, 1, capacity - *size, f);
+        if (*size < capacity)
+            break;
+        buff = realloc(buff, capacity *= 2);
+    }
+    if (ferror(f)) {
+        perror("Error reading input");
+        exit(EXIT_FAILURE);
+    }
+    return buff;
+}
+
+int main(int argc, char *argv[]) {
+    const char *program = *argv;
+
+    bool *help = flag_bool("help", 'h', "Print this help to stdout and exit with 0");
+    bool *whitelist = flag_bool("whitelist", 'w', "Argument file is a whilelist in stead of a blacklist");
+    bool *all = flag_bool("all", 0, "A line only counts as listed if it is in all blacklist-files");
+    bool *ignore_case = flag_bool("ignore-case", 'i', "Ignore ASCII case");
+    bool *substring = flag_bool("substring", 0, "A line is listed if it contains a line of a blacklist-file");
+    bool *prefix = flag_bool("prefix", 0, "A line is listed if it starts with a line of a blacklist-file");
+    bool *buffer = flag_bool("buffer", 0, "Index the single blacklist-file through blacklist_from_buffer");
+
+    if (!flag_parse(argc, argv)) {
+        usage(stderr, program);
+        flag_print_error(stderr);
+        exit(1);
+    }
+    argv = flag_rest_argv();
+    size_t file_count = flag_rest_argc();
+    if (*help) {
+        usage(stdout, program);
+        exit(0);
+    }
+    if (file_count == 0 || (*buffer && file_count != 1)) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: a blacklist-file is needed, a single one with --buffer\n");
+        exit(1);
+    }
+
+    blacklist_options options = {
+        .match = *substring ? BLACKLIST_SUBSTRING : *prefix ? BLACKLIST_PREFIX : BLACKLIST_EXACT,
+        .whitelist = *whitelist,
+        .all = *all,
+        .ignore_case = *ignore_case,
+    };
+    blacklist_index *bl;
+    if (*buffer) {
+        FILE *f = fopen(argv[0], "rb");
+        if (!f) {
+            perror("Error opening file");
+            exit(EXIT_FAILURE);
+        }
+        size_t size;
+        char *data = readAll(f, &size);
+        fclose(f);
+        bl = blacklist_from_buffer(data, size, &options);
+        free(data); // The index has its own copy
+    } else {
+        bl = blacklist_open(argv, file_count, &options);
+    }
+    if (!bl)
+        exit(EXIT_FAILURE);
+
+    size_t size;
+    char *input = readAll(stdin, &size);
+    blacklist_line *lines = malloc((size + 1) * sizeof(blacklist_line));
+    uint64_t *keep = malloc((size / 64 + 1) * sizeof(uint64_t));
+    if (!lines || !keep) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+    size_t count = 0;
+    for (size_t start = 0; start < size;) {
+        const char *nl = memchr(input + start, '\n', size - start);
+        size_t end = nl ? (size_t)(nl - input) : size;
+        lines[count++] = (blacklist_line) { .data = input + start, .len = end - start };
+        start = end + 1;
+    }
+
+    size_t kept = blacklist_filter(bl, lines, count, keep);
+    size_t printed = 0;
+    for (size_t i = 0; i < count; ++i) {
+        bool listed = blacklist_contains(bl, lines[i].data, lines[i].len);
+        bool kept_line = keep[i / 64] >> (i % 64) & 1;
+        if (listed != (kept_line == *whitelist)) {
+            fprintf(stderr, "ERROR: line %zu: blacklist_filter and blacklist_contains disagree\n", i + 1);
+            exit(EXIT_FAILURE);
+        }
+        if (kept_line) {
+            fwrite(lines[i].data, 1, lines[i].len, stdout);
+            fputc('\n', stdout);
+            ++printed;
+        }
+    }
+    if (printed != kept) {
+        fprintf(stderr, "ERROR: blacklist_filter kept %zu lines, but marked %zu\n", kept, printed);
+        exit(EXIT_FAILURE);
+    }
+
+    blacklist_close(bl);
+    free(keep);
+    free(lines);
+    free(input);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+#!/bin/sh
+# Filters generated inputs every way blacklist can and compares the output
+# with the plain hash index, see make check. Prints the cases that differ
+# and exits with 1 if there are any.
+#
+#     ./check.sh [<blacklist-binary> [<library-driver>]]
+
+BLACKLIST=${1:-./blacklist}
+DRIVER=${2:-./blacklist-check}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/blacklist-check.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+FAILED=0
+CASES=0
+
+# Keys k0 to k1999 in both cases, some long, with empty lines and
+# duplicates; the last line has no newline
+gen() { # <seed> <lines> <file>
+    awk -v seed="$1" -v n="$2" 'BEGIN {
+        srand(seed)
+        for (i = 0; i < n; ++i) {
+            r = rand()
+            if (r < 0.03)
+                line = ""
+            else if (r < 0.06)
+                line = sprintf("x%0300d", int(rand() * 50))
+            else
+                line = sprintf("%s%d", rand() < 0.1 ? "K" : "k", int(rand() * 2000))
+            printf "%s%s", line, i + 1 < n ? "\n" : ""
+        }
+    }' > "$3"
+}
+
+# Compares the output of a command with the expected one
+same() { # <name> <expected> <command>...
+    what=$1
+    want=$2
+    shift 2
+    CASES=$((CASES + 1))
+    "$@" > "$DIR/got" 2> "$DIR/err" < "$INPUT"
+    status=$?
+    if [ "$status" != 0 ]; then
+        echo "FAIL $what: exit $status, $(tail -n 1 "$DIR/err")"
+        FAILED=1
+    elif ! cmp -s "$want" "$DIR/got"; then
+        echo "FAIL $what: the output differs from the expected one"
+        FAILED=1
+    fi
+}
+
+# Every way of filtering the input with the lists and options, $OPTS is
+# split on purpose
+check() { # <case>
+    INPUT=$DIR/$1.in
+    LIST1=$DIR/$1.list1
+    LIST2=$DIR/$1.list2
+    for OPTS in "" "-w" "-u" "-i" "-w -i" "--all" "--select +-"; do
+        name="$1 [$OPTS]"
+        expected=$DIR/expected
+        if ! "$BLACKLIST" --index hash $OPTS "$LIST1" "$LIST2" < "$INPUT" > "$expected"; then
+            echo "FAIL $name: the hash index fails"
+            FAILED=1
+            continue
+        fi
+        for kind in auto small sorted inline; do
+            same "$name --index $kind" "$expected" "$BLACKLIST" --index "$kind" $OPTS "$LIST1" "$LIST2"
+        done
+        same "$name --mph" "$expected" "$BLACKLIST" --mph $OPTS "$LIST1" "$LIST2"
+        same "$name --bloom" "$expected" "$BLACKLIST" --bloom 10 $OPTS "$LIST1" "$LIST2"
+        same "$name -j" "$expected" "$BLACKLIST" -j 4 $OPTS "$LIST1" "$LIST2"
+        same "$name --memory-limit" "$expected" "$BLACKLIST" --memory-limit 1K $OPTS "$LIST1" "$LIST2"
+
+        case "$OPTS" in *-i*) fold=-i ;; *) fold= ;; esac
+        if "$BLACKLIST" --compile $fold -o "$DIR/index.blx" "$LIST1" "$LIST2" 2> "$DIR/err"; then
+            same "$name --compile" "$expected" "$BLACKLIST" $OPTS "$DIR/index.blx"
+            same "$name --compile -j" "$expected" "$BLACKLIST" -j 4 $OPTS "$DIR/index.blx"
+        else
+            echo "FAIL $name --compile: $(tail -n 1 "$DIR/err")"
+            FAILED=1
+        fi
+
+        case "$OPTS" in
+        *-u*|*--select*) ;; # Not in the library
+        *) same "$name library" "$expected" "$DRIVER" $OPTS "$LIST1" "$LIST2" ;;
+        esac
+    done
+
+    # The library only has a buffer of a single list
+    INPUT=$DIR/$1.in
+    "$BLACKLIST" "$LIST1" < "$INPUT" > "$DIR/expected"
+    same "$1 library buffer" "$DIR/expected" "$DRIVER" --buffer "$LIST1"
+
+    # --substring and --prefix have no hash index, the library has to agree
+    for match in --substring --prefix; do
+        for OPTS in "" "-w" "-i"; do
+            "$BLACKLIST" $match $OPTS "$LIST1" "$LIST2" < "$INPUT" > "$DIR/expected"
+            same "$1 [$OPTS] $match library" "$DIR/expected" "$DRIVER" $match $OPTS "$LIST1" "$LIST2"
+        done
+    done
+
+    # --sorted merges sorted files, expected from the hash index of the same
+    LC_ALL=C sort "$LIST1" > "$DIR/sorted.list1"
+    LC_ALL=C sort "$LIST2" > "$DIR/sorted.list2"
+    LC_ALL=C sort "$DIR/$1.in" > "$DIR/sorted.in"
+    INPUT=$DIR/sorted.in
+    for OPTS in "" "-w" "-u" "--all"; do
+        "$BLACKLIST" --index hash $OPTS "$DIR/sorted.list1" "$DIR/sorted.list2" < "$INPUT" > "$DIR/expected"
+        same "$1 [$OPTS] --sorted" "$DIR/expected" "$BLACKLIST" --sorted $OPTS "$DIR/sorted.list1" "$DIR/sorted.list2"
+    done
+}
+
+gen 1 3000 "$DIR/big.list1"
+gen 2 3000 "$DIR/big.list2"
+gen 3 20000 "$DIR/big.in"
+check big
+
+# Lines without a newline, empty ones and nothing at all
+printf 'a\n\nb' > "$DIR/edge.list1"
+printf '\n\nB\nc\n' > "$DIR/edge.list2"
+printf '\n\na\nb\nC\nd\n\nb' > "$DIR/edge.in"
+check edge
+printf '' > "$DIR/empty.in"
+cp "$DIR/edge.list1" "$DIR/empty.list1"
+printf '' > "$DIR/empty.list2"
+check empty
+
+# The hash index itself, against lines worked out by hand
+INPUT=$DIR/edge.in
+printf '\n\nC\nd\n\n' > "$DIR/expected"
+same "edge by hand" "$DIR/expected" "$BLACKLIST" --index hash "$DIR/edge.list1" "$DIR/edge.list2"
+
+if [ "$FAILED" = 0 ]; then
+    echo "check: $CASES cases ok"
+fi
+exit "$FAILED"
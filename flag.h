@@ -44,16 +44,18 @@
 #include <string.h>
 #include <errno.h>
 
-// TODO: add support for -flag=x syntax
-
 char       *flag_name(void *val);
 bool       *flag_bool(const char *name, char char_name, const char *desc);
 uint64_t   *flag_uint64(const char *name, uint64_t def, const char *desc);
 size_t     *flag_size(const char *name, uint64_t def, const char *desc);
 char       *flag_char(const char *name, char def, const char *desc);
 char      **flag_str(const char *name, const char *def, const char *desc);
+// A string flag whose value is optional: NULL unless given, `bare` if given
+// as --name and the value if given as --name=value
+char      **flag_opt_str(const char *name, const char *bare, const char *desc);
 
 void        flag_set_variant(void *val, const char *variant);
+void        flag_set_char_name(void *val, const char char_name);
 
 bool    flag_parse(int argc, char **argv);
 int     flag_rest_argc(void);
@@ -95,6 +97,7 @@ typedef enum {
     FLAG_ERROR_INVALID_NUMBER,
     FLAG_ERROR_INTEGER_OVERFLOW,
     FLAG_ERROR_INVALID_SIZE_SUFFIX,
+    FLAG_ERROR_UNEXPECTED_VALUE,
     COUNT_FLAG_ERRORS,
 } Flag_Error;
 
@@ -108,6 +111,7 @@ typedef struct {
     char *variant;
     char char_name;
     char *desc;
+    char *bare;     // Value of an optional value flag given without one
     Flag_Value val;
     Flag_Value def;
 } Flag;
@@ -237,6 +241,13 @@ char **flag_str(const char *name, const char *def, const char *desc)
     return &flag->val.as_str;
 }
 
+char **flag_opt_str(const char *name, const char *bare, const char *desc)
+{
+    Flag *flag = flag_new(FLAG_STR, name, desc);
+    flag->bare = (char*) bare;
+    return &flag->val.as_str;
+}
+
 static char *flag_shift_args(int *argc, char ***argv)
 {
     assert(*argc > 0);
@@ -246,6 +257,15 @@ static char *flag_shift_args(int *argc, char ***argv)
     return result;
 }
 
+// The value of a flag, given after '=' or else as the next arg, NULL if there
+// is none
+static char *flag_take_value(char *value, int *argc, char ***argv)
+{
+    if (value)
+        return value;
+    return *argc > 0 ? flag_shift_args(argc, argv) : NULL;
+}
+
 int flag_rest_argc(void)
 {
     return flag_global_context.rest_argc;
@@ -262,27 +282,31 @@ bool flag_parse(int argc, char **argv)
 
     flag_shift_args(&argc, &argv);
 
+    // NOTE: non-flag args may be mixed with flags, they are moved in order
+    // to the front of argv, into slots that have already been parsed
+    char **rest = argv;
+    int rest_count = 0;
+
     while (argc > 0) {
         char *arg = flag_shift_args(&argc, &argv);
 
         if (*arg != '-') {
-            // NOTE: pushing arg back into args
-            c->rest_argc = argc + 1;
-            c->rest_argv = argv - 1;
-            return true;
+            rest[rest_count++] = arg;
+            continue;
         }
 
         if (strcmp(arg, "--") == 0) {
-            // NOTE: but if it's the terminator we don't need to push it back
-            c->rest_argc = argc;
-            c->rest_argv = argv;
-            return true;
+            // NOTE: everything after the terminator is a non-flag arg
+            while (argc > 0)
+                rest[rest_count++] = flag_shift_args(&argc, &argv);
+            break;
         }
 
         // NOTE: remove the dash
         arg += 1;
     
         Flag *flag;
+        char *value = NULL; // Of --flag=value
         
         if (*arg != '-') { // Parse char flags
             char ch = *arg | 0x20; // to_lowercase
@@ -320,6 +344,11 @@ bool flag_parse(int argc, char **argv)
         {
             // NOTE: remove the second dash
             arg += 1;
+            char *eq = strchr(arg, '=');
+            if (eq) {
+                *eq = '\0';
+                value = eq + 1;
+            }
             flag = flag_find_by_name(arg);
         }
 
@@ -333,17 +362,23 @@ bool flag_parse(int argc, char **argv)
         static_assert(COUNT_FLAG_TYPES == 5, "Exhaustive flag type parsing");
         switch (flag->type) {
         case FLAG_BOOL: {
+            if (value) {
+                c->flag_error = FLAG_ERROR_UNEXPECTED_VALUE;
+                c->flag_error_name = arg;
+                c->flag_error_value = value;
+                return false;
+            }
             flag->val.as_bool = true;
         }
         break;
 
         case FLAG_CHAR: {
-            if (argc == 0) {
+            char *value_arg = flag_take_value(value, &argc, &argv);
+            if (!value_arg) {
                 c->flag_error = FLAG_ERROR_NO_VALUE;
                 c->flag_error_name = arg;
                 return false;
             }
-            char *value_arg = flag_shift_args(&argc, &argv);
             if(strlen(value_arg) > 1) {
                 c->flag_error = FLAG_ERROR_INVALID_CHAR;
                 c->flag_error_name = flag->name;
@@ -355,23 +390,27 @@ bool flag_parse(int argc, char **argv)
         break;
 
         case FLAG_STR: {
-            if (argc == 0) {
+            if (flag->bare && !value) {
+                flag->val.as_str = flag->bare;
+                break;
+            }
+            char *value_arg = flag_take_value(value, &argc, &argv);
+            if (!value_arg) {
                 c->flag_error = FLAG_ERROR_NO_VALUE;
                 c->flag_error_name = flag->name;
                 return false;
             }
-            char *arg = flag_shift_args(&argc, &argv);
-            flag->val.as_str = arg;
+            flag->val.as_str = value_arg;
         }
         break;
 
         case FLAG_UINT64: {
-            if (argc == 0) {
+            char *value_arg = flag_take_value(value, &argc, &argv);
+            if (!value_arg) {
                 c->flag_error = FLAG_ERROR_NO_VALUE;
                 c->flag_error_name = flag->name;
                 return false;
             }
-            char *value_arg = flag_shift_args(&argc, &argv);
 
             static_assert(sizeof(unsigned long long int) == sizeof(uint64_t), "The original author designed this for x86_64 machine with the compiler that expects unsigned long long int and uint64_t to be the same thing, so they could use strtoull() function to parse it. Please adjust this code for your case and maybe even send the patch to upstream to make it work on a wider range of environments.");
             char *endptr;
@@ -398,12 +437,12 @@ bool flag_parse(int argc, char **argv)
         break;
 
         case FLAG_SIZE: {
-            if (argc == 0) {
+            char *value_arg = flag_take_value(value, &argc, &argv);
+            if (!value_arg) {
                 c->flag_error = FLAG_ERROR_NO_VALUE;
                 c->flag_error_name = arg;
                 return false;
             }
-            char *value_arg = flag_shift_args(&argc, &argv);
 
             static_assert(sizeof(unsigned long long int) == sizeof(size_t), "The original author designed this for x86_64 machine with the compiler that expects unsigned long long int and size_t to be the same thing, so they could use strtoull() function to parse it. Please adjust this code for your case and maybe even send the patch to upstream to make it work on a wider range of environments.");
             char *endptr;
@@ -451,8 +490,9 @@ bool flag_parse(int argc, char **argv)
 
     }
 
-    c->rest_argc = argc;
-    c->rest_argv = argv;
+    rest[rest_count] = NULL;
+    c->rest_argc = rest_count;
+    c->rest_argv = rest;
     return true;
 }
 
@@ -462,7 +502,9 @@ void flag_print_options(FILE *stream)
     for (size_t i = 0; i < c->flags_count; ++i) {
         Flag *flag = &c->flags[i];
 
-        if (flag->char_name)
+        if (flag->bare)
+          fprintf(stream, "      --%s[=value]\n", flag->name);
+        else if (flag->char_name)
           fprintf(stream, "  -%c, --%s\n", flag->char_name, flag->name);
         else if (flag->variant)
           fprintf(stream, "  --%s, --%s\n", flag->variant, flag->name);
@@ -500,7 +542,7 @@ void flag_print_options(FILE *stream)
 void flag_print_error(FILE *stream)
 {
     Flag_Context *c = &flag_global_context;
-    static_assert(COUNT_FLAG_ERRORS == 9, "Exhaustive flag error printing");
+    static_assert(COUNT_FLAG_ERRORS == 10, "Exhaustive flag error printing");
     switch (c->flag_error) {
     case FLAG_NO_ERROR:
         // NOTE: don't call flag_print_error() if flag_parse() didn't return false, okay? ._.
@@ -532,6 +574,9 @@ void flag_print_error(FILE *stream)
     case FLAG_ERROR_INVALID_SIZE_SUFFIX:
         fprintf(stream, "ERROR: -%s: invalid size suffix, got '%s'\n", c->flag_error_name, c->flag_error_value);
         break;
+    case FLAG_ERROR_UNEXPECTED_VALUE:
+        fprintf(stream, "ERROR: --%s: takes no value, got '%s'\n", c->flag_error_name, c->flag_error_value);
+        break;
     case COUNT_FLAG_ERRORS:
     default:
         assert(0 && "unreachable");